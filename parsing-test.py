@@ -21,3 +21,62 @@ c.expect_exact(':: UNFINISHED: <foo><bar><baz>BarText</baz></bar>Some other text
 c.sendline('o>')
 c.expect_exact(':: FINISHED: <foo><bar><baz>BarText</baz></bar>Some other text</foo>')
 c.send(EOF)
+
+# Entity and character references
+c = pexpect.spawn('./qweparsetest', timeout=1)
+c.sendline('<a x="1 &amp; 2">&lt;b&gt; &#x41;&#66; &#x44f;</a>')
+c.expect_exact(b':: FINISHED: <a x="1 &amp; 2">&lt;b&gt; AB \xd1\x8f</a>')
+c.send(EOF)
+
+# Reference split between portions
+c = pexpect.spawn('./qweparsetest', timeout=1)
+c.sendline('<a>x &am')
+c.expect_exact(':: UNFINISHED: <a></a>')
+c.sendline('p; y</a>')
+c.expect_exact(':: FINISHED: <a>x &amp; y</a>')
+c.send(EOF)
+
+# Escaping of long text runs
+c = pexpect.spawn('./qweparsetest', timeout=1)
+c.sendline('<a q="&quot;1&quot;">some long text without specials &gt; then more text</a>')
+c.expect_exact(':: FINISHED: <a q="&quot;1&quot;">some long text without specials &gt; then more text</a>')
+c.send(EOF)
+
+# Comments, CDATA sections and DOCTYPE
+c = pexpect.spawn('./qweparsetest', timeout=1)
+c.sendline('<!DOCTYPE n [<!ELEMENT n (#PCDATA)>]><n>a<!-- <b> -- -->b<![CDATA[<&]] ]]>c</n>')
+c.expect_exact(':: FINISHED: <n>ab&lt;&amp;]] c</n>')
+c.send(EOF)
+
+# CDATA terminator split between portions
+c = pexpect.spawn('./qweparsetest', timeout=1)
+c.sendline('<a><![CDATA[x]')
+c.expect_exact(':: UNFINISHED: <a></a>')
+c.sendline(']')
+c.expect_exact(':: UNFINISHED: <a></a>')
+c.sendline('>y</a>')
+c.expect_exact(':: FINISHED: <a>xy</a>')
+c.send(EOF)
+
+# Whitespace modes
+c = pexpect.spawn('./qweparsetest preserve', timeout=1)
+c.sendline('<top>\t<foo> TEXT</foo>But  not  here </top>')
+c.expect_exact(':: FINISHED: <top>\t<foo> TEXT</foo>But  not  here </top>')
+c.send(EOF)
+
+c = pexpect.spawn('./qweparsetest normalize', timeout=1)
+c.sendline('<top>\t<foo> TEXT </foo>But \t not')
+c.expect_exact(':: UNFINISHED: <top><foo>TEXT</foo>But not</top>')
+c.sendline('  here </top>')
+c.expect_exact(':: FINISHED: <top><foo>TEXT</foo>But not here</top>')
+c.send(EOF)
+
+# Errors are reported and parser is reset
+c = pexpect.spawn('./qweparsetest', timeout=1)
+c.sendline('<a><b></a>')
+c.expect_exact(':: ERROR: Unbalanced opening and closing tags at 1:7 (offset 6, depth 2)')
+c.sendline('<a x=1/>')
+c.expect_exact(':: ERROR: Error while reading tag at 1:6 (offset 5, depth 0)')
+c.sendline('<a>ok</a>')
+c.expect_exact(':: FINISHED: <a>ok</a>')
+c.send(EOF)
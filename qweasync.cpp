@@ -0,0 +1,239 @@
+#include <utility>
+#include "qweasync.hpp"
+
+namespace qwe {
+    /**
+     * Coroutines queued while running are resumed in the same call,
+     * so queue is only cleared when everything has run.
+     */
+    void Executor::schedule(std::coroutine_handle <> h)
+    {
+        ready.push_item(h);
+    }
+
+    /**
+     * Cancelled entry is replaced rather than removed, since run()
+     * may be iterating over the queue.
+     */
+    void Executor::cancel(std::coroutine_handle <> h)
+    {
+        for (int i = 0; i < ready.get_length(); i++)
+            if (ready[i] == h)
+                ready[i] = std::noop_coroutine();
+    }
+
+    void Executor::run(void)
+    {
+        for (int i = 0; i < ready.get_length(); i++)
+            ready[i].resume();
+        ready.clear();
+    }
+
+    BufferQueue::BufferQueue(Executor &e)
+        :executor(e), first(0), closed(false)
+    {}
+
+    BufferQueue::~BufferQueue(void)
+    {
+        for (int i = first; i < buffers.get_length(); i++)
+            delete buffers[i];
+    }
+
+    void BufferQueue::wake(void)
+    {
+        if (waiting)
+        {
+            executor.schedule(waiting);
+            waiting = 0;
+        }
+    }
+
+    void BufferQueue::push(const char *s, size_t n)
+    {
+        String *b = new String();
+        b->append(s, n);
+        buffers.push_item(b);
+        wake();
+    }
+
+    void BufferQueue::close(void)
+    {
+        closed = true;
+        wake();
+    }
+
+    BufferQueue::ReadAwaiter BufferQueue::read(String &out)
+    {
+        return ReadAwaiter(*this, out);
+    }
+
+    BufferQueue::ReadAwaiter::ReadAwaiter(BufferQueue &q, String &s)
+        :queue(q), out(s)
+    {}
+
+    /**
+     * Awaiter is destroyed with the frame of suspended consumer, which
+     * is either still waiting or already scheduled by wake().
+     */
+    BufferQueue::ReadAwaiter::~ReadAwaiter(void)
+    {
+        if (!suspended)
+            return;
+        if (queue.waiting == suspended)
+            queue.waiting = 0;
+        else
+            queue.executor.cancel(suspended);
+    }
+
+    bool BufferQueue::ReadAwaiter::await_ready(void)
+    {
+        return queue.first < queue.buffers.get_length() || queue.closed;
+    }
+
+    void BufferQueue::ReadAwaiter::await_suspend(std::coroutine_handle <> h)
+    {
+        queue.waiting = h;
+        suspended = h;
+    }
+
+    /**
+     * Buffer list is emptied once all buffers have been read.
+     */
+    bool BufferQueue::ReadAwaiter::await_resume(void)
+    {
+        suspended = 0;
+        if (queue.first == queue.buffers.get_length())
+            return false;
+
+        String *b = queue.buffers[queue.first++];
+        out = std::move(*b);
+        delete b;
+        if (queue.first == queue.buffers.get_length())
+        {
+            queue.buffers.clear();
+            queue.first = 0;
+        }
+        return true;
+    }
+
+    Task::Task(std::coroutine_handle <promise_type> h)
+        :handle(h)
+    {}
+
+    Task::Task(Task &&t)
+        :handle(t.handle)
+    {
+        t.handle = 0;
+    }
+
+    Task::~Task(void)
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool Task::is_done(void)
+    {
+        return handle.done();
+    }
+
+    std::coroutine_handle <> SubtreeStream::ConsumerResumer::await_suspend(Handle h) noexcept
+    {
+        NextAwaiter *w = h.promise().waiter;
+        if (w)
+            return w->consumer;
+        return std::noop_coroutine();
+    }
+
+    /**
+     * Parsing coroutine is resumed directly, remembering consumer to
+     * return to.
+     */
+    std::coroutine_handle <> SubtreeStream::NextAwaiter::await_suspend(std::coroutine_handle <> h)
+    {
+        consumer = h;
+        producer.promise().waiter = this;
+        return producer;
+    }
+
+    SubtreeStream::NextAwaiter::~NextAwaiter(void)
+    {
+        if (consumer && producer)
+            producer.promise().waiter = 0;
+    }
+
+    ElementNode* SubtreeStream::NextAwaiter::await_resume(void)
+    {
+        if (consumer)
+        {
+            producer.promise().waiter = 0;
+            consumer = 0;
+        }
+        ElementNode *e = producer.promise().current;
+        producer.promise().current = 0;
+        return e;
+    }
+
+    SubtreeStream::SubtreeStream(Handle h)
+        :handle(h)
+    {}
+
+    SubtreeStream::SubtreeStream(SubtreeStream &&s)
+        :handle(s.handle)
+    {
+        s.handle = 0;
+    }
+
+    /**
+     * Consumer still waiting for the next subtree is never resumed.
+     */
+    SubtreeStream::~SubtreeStream(void)
+    {
+        if (!handle)
+            return;
+        if (handle.promise().waiter)
+            handle.promise().waiter->producer = 0;
+        delete handle.promise().current;
+        handle.destroy();
+    }
+
+    SubtreeStream::NextAwaiter SubtreeStream::next(void)
+    {
+        return NextAwaiter{handle};
+    }
+
+    error_type SubtreeStream::get_error(void)
+    {
+        return handle.promise().error;
+    }
+
+    SubtreeCollector::SubtreeCollector(void)
+        :first(0)
+    {}
+
+    SubtreeCollector::~SubtreeCollector(void)
+    {
+        for (int i = first; i < pending.get_length(); i++)
+            delete pending[i];
+    }
+
+    bool SubtreeCollector::handle(ElementNode *e)
+    {
+        pending.push_item(e);
+        return false;
+    }
+
+    ElementNode* SubtreeCollector::take(void)
+    {
+        if (first == pending.get_length())
+            return 0;
+
+        ElementNode *e = pending[first++];
+        if (first == pending.get_length())
+        {
+            pending.clear();
+            first = 0;
+        }
+        return e;
+    }
+}
@@ -0,0 +1,401 @@
+#ifndef QWE_ASYNC_H
+#define QWE_ASYNC_H
+#include <coroutine>
+#include <exception>
+#include "qweparse.hpp"
+
+/**
+ * Coroutine front end of parser (requires C++20).
+ *
+ * Document is parsed by a coroutine which awaits buffers from an
+ * asynchronous source and yields completed subtrees, so that parser
+ * state of each connection lives in a coroutine frame. Coroutines
+ * are resumed by Executor in the thread which runs it.
+ */
+
+namespace qwe {
+    /**
+     * Single-threaded run queue of coroutines.
+     */
+    class Executor {
+    private:
+        Vector <std::coroutine_handle <> > ready;
+
+    public:
+        /**
+         * Queue coroutine to be resumed by run().
+         */
+        void schedule(std::coroutine_handle <> h);
+
+        /**
+         * Drop coroutine @a h from the queue, so that it is not
+         * resumed after its frame is destroyed.
+         */
+        void cancel(std::coroutine_handle <> h);
+
+        /**
+         * Resume queued coroutines, including those queued meanwhile,
+         * until none is ready.
+         */
+        void run(void);
+    };
+
+    /**
+     * In-memory asynchronous source of buffers.
+     *
+     * Producer pushes buffers and closes the queue, consumer reads
+     * them with <code>co_await queue.read(s)</code>, which suspends
+     * it until a buffer or end of input comes. Only one consumer may
+     * wait at a time. Consumer may be destroyed while it waits; it is
+     * then forgotten by queue and executor.
+     */
+    class BufferQueue {
+    private:
+        Executor &executor;
+
+        Vector <String *> buffers;
+
+        /**
+         * Index of the first buffer not read yet.
+         */
+        int first;
+
+        bool closed;
+
+        /**
+         * Consumer suspended until the next buffer, if any.
+         */
+        std::coroutine_handle <> waiting;
+
+        /**
+         * Schedule waiting consumer.
+         */
+        void wake(void);
+
+        BufferQueue(const BufferQueue &q);
+        BufferQueue& operator =(const BufferQueue &q);
+    public:
+        /**
+         * Awaiter returned by read().
+         */
+        class ReadAwaiter {
+        private:
+            BufferQueue &queue;
+            String &out;
+
+            /**
+             * Consumer while it is suspended, so that it may be
+             * forgotten if its frame is destroyed.
+             */
+            std::coroutine_handle <> suspended;
+        public:
+            ReadAwaiter(BufferQueue &q, String &s);
+
+            ~ReadAwaiter(void);
+
+            bool await_ready(void);
+
+            void await_suspend(std::coroutine_handle <> h);
+
+            /**
+             * @return False if queue is closed and empty.
+             */
+            bool await_resume(void);
+        };
+
+        /**
+         * Waiting consumers are resumed by @a e.
+         */
+        BufferQueue(Executor &e);
+
+        ~BufferQueue(void);
+
+        /**
+         * Append copy of @a n characters as the next buffer.
+         */
+        void push(const char *s, size_t n);
+
+        /**
+         * Mark end of input.
+         */
+        void close(void);
+
+        /**
+         * Awaitable which moves the next buffer into @a out.
+         */
+        ReadAwaiter read(String &out);
+    };
+
+    /**
+     * Coroutine type which starts at once and keeps its frame until
+     * destroyed, so that caller may check if it has finished.
+     */
+    class Task {
+    public:
+        struct promise_type {
+            Task get_return_object(void)
+            {
+                return Task(std::coroutine_handle <promise_type>::from_promise(*this));
+            }
+
+            std::suspend_never initial_suspend(void) noexcept
+            {
+                return {};
+            }
+
+            std::suspend_always final_suspend(void) noexcept
+            {
+                return {};
+            }
+
+            void return_void(void)
+            {}
+
+            void unhandled_exception(void)
+            {
+                std::terminate();
+            }
+        };
+
+        Task(Task &&t);
+
+        ~Task(void);
+
+        bool is_done(void);
+
+    private:
+        std::coroutine_handle <promise_type> handle;
+
+        Task(std::coroutine_handle <promise_type> h);
+
+        Task(const Task &t);
+        Task& operator =(const Task &t);
+    };
+
+    /**
+     * Asynchronous stream of completed subtrees yielded by
+     * parse_subtrees().
+     *
+     * Consumer coroutine gets subtrees one by one with
+     * <code>co_await stream.next()</code>, which resumes parsing
+     * coroutine until it yields. Control passes between the two
+     * directly, without executor.
+     */
+    class SubtreeStream {
+    public:
+        struct promise_type;
+        struct NextAwaiter;
+        typedef std::coroutine_handle <promise_type> Handle;
+
+        /**
+         * Suspends parsing coroutine and resumes its consumer.
+         */
+        struct ConsumerResumer {
+            bool await_ready(void) noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle <> await_suspend(Handle h) noexcept;
+
+            void await_resume(void) noexcept
+            {}
+        };
+
+        struct promise_type {
+            /**
+             * Subtree yielded and not taken by consumer yet.
+             */
+            ElementNode *current;
+
+            /**
+             * Awaiter of suspended consumer, 0 if none waits.
+             */
+            NextAwaiter *waiter;
+
+            error_type error;
+
+            promise_type(void)
+                :current(0), waiter(0), error(PARSE_OK)
+            {}
+
+            SubtreeStream get_return_object(void)
+            {
+                return SubtreeStream(Handle::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend(void) noexcept
+            {
+                return {};
+            }
+
+            ConsumerResumer final_suspend(void) noexcept
+            {
+                return {};
+            }
+
+            ConsumerResumer yield_value(ElementNode *e)
+            {
+                current = e;
+                return {};
+            }
+
+            void return_value(error_type e)
+            {
+                current = 0;
+                error = e;
+            }
+
+            void unhandled_exception(void)
+            {
+                std::terminate();
+            }
+        };
+
+        /**
+         * Awaiter returned by next().
+         */
+        struct NextAwaiter {
+            /**
+             * Parsing coroutine, 0 once its stream is destroyed.
+             */
+            Handle producer;
+
+            /**
+             * Consumer while it is suspended. Awaiter is destroyed
+             * with its frame and then detaches from producer.
+             */
+            std::coroutine_handle <> consumer;
+
+            ~NextAwaiter(void);
+
+            /**
+             * Subtree yielded while no consumer waited is taken
+             * without resuming producer.
+             */
+            bool await_ready(void)
+            {
+                return producer.done() || producer.promise().current;
+            }
+
+            std::coroutine_handle <> await_suspend(std::coroutine_handle <> h);
+
+            ElementNode* await_resume(void);
+        };
+
+        SubtreeStream(SubtreeStream &&s);
+
+        /**
+         * Parsing coroutine is destroyed, wherever it is suspended,
+         * with subtree yielded but not taken.
+         */
+        ~SubtreeStream(void);
+
+        /**
+         * Awaitable which resumes parsing until the next subtree.
+         *
+         * Awaiting gives the subtree, which is owned by consumer, or
+         * 0 when document has ended.
+         */
+        NextAwaiter next(void);
+
+        /**
+         * Error which ended the stream, PARSE_OK if document has been
+         * completely read.
+         */
+        error_type get_error(void);
+
+    private:
+        Handle handle;
+
+        SubtreeStream(Handle h);
+
+        SubtreeStream(const SubtreeStream &s);
+        SubtreeStream& operator =(const SubtreeStream &s);
+    };
+
+    /**
+     * Handler which keeps completed subtrees until they are taken.
+     */
+    class SubtreeCollector : public SubtreeHandler {
+    private:
+        Vector <ElementNode *> pending;
+
+        /**
+         * Index of the first subtree not taken yet.
+         */
+        int first;
+
+    public:
+        SubtreeCollector(void);
+
+        /**
+         * Subtrees which have not been taken are freed.
+         */
+        ~SubtreeCollector(void);
+
+        bool handle(ElementNode *e);
+
+        /**
+         * Pass the oldest kept subtree to caller.
+         *
+         * @return Subtree or 0 if none is kept.
+         */
+        ElementNode* take(void);
+    };
+
+    /**
+     * Parse document read from @a source, yielding elements selected
+     * by @a query as soon as their closing tags are read.
+     *
+     * Source is any object whose <code>read(String &)</code> method
+     * returns an awaitable giving false at the end of input, like
+     * BufferQueue. Parser lives in the coroutine frame.
+     *
+     * Stream ends with parser error if document is malformed, with
+     * UNBALANCED_TAG if input ends before the top-level element is
+     * opened or closed and with UNKNOWN_TOKEN if query is invalid.
+     *
+     * @param query Query copied into coroutine frame when it is
+     * created, so it may be a temporary. Source must outlive stream.
+     *
+     * @param memory_budget Memory budget of parser (see
+     * XmlParser::set_memory_budget()), 0 for unlimited. Yielded
+     * subtrees do not count against it.
+     */
+    template <class Source>
+    SubtreeStream parse_subtrees(Source &source, String query,
+                                 size_t memory_budget = 0)
+    {
+        XmlParser parser;
+        SubtreeCollector collector;
+        parser.set_memory_budget(memory_budget);
+        /// Query is compiled from zero-terminated characters
+        query += '\0';
+        if (!parser.add_handler(query.get_data(), &collector))
+            co_return UNKNOWN_TOKEN;
+
+        /// Top-level element may already be taken by collector
+        bool opened = false;
+        String data;
+        while (co_await source.read(data))
+        {
+            MemoryBuffer buffer(data.get_data(), data.get_length());
+            std::istream in(&buffer);
+            bool ok = parser.feed(in);
+            if (parser.top())
+                opened = true;
+
+            ElementNode *e;
+            while ((e = collector.take()))
+            {
+                opened = true;
+                co_yield e;
+            }
+            if (!ok)
+                co_return parser.get_error().type;
+        }
+        co_return opened && parser.is_finished() ? PARSE_OK : UNBALANCED_TAG;
+    }
+}
+#endif
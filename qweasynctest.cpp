@@ -0,0 +1,199 @@
+#include <iostream>
+#include <string>
+#include "qweasync.hpp"
+
+using namespace qwe;
+
+int failed = 0;
+
+void check(bool cond, const char *name)
+{
+    if (cond)
+        std::cout << name << " test passed" << std::endl;
+    else
+    {
+        std::cout << name << " test FAILED" << std::endl;
+        failed++;
+    }
+}
+
+/**
+ * Consumer which appends id attributes of yielded elements.
+ */
+Task collect(SubtreeStream &s, String &ids)
+{
+    ElementNode *e;
+    while ((e = co_await s.next()))
+    {
+        ids += e->get_attribute(0)->get_value();
+        delete e;
+    }
+}
+
+/**
+ * Push document to queue in chunks, running executor after each.
+ */
+void push_chunks(BufferQueue &q, Executor &ex, const std::string &s, int chunk)
+{
+    for (size_t i = 0; i < s.size(); i += chunk)
+    {
+        std::string part = s.substr(i, chunk);
+        q.push(part.data(), part.size());
+        ex.run();
+    }
+}
+
+int main()
+{
+    std::string log("<log>");
+    for (int i = 0; i < 10; i++)
+        log += "<entry id=\"" + std::to_string(i) + "\"><m>text</m></entry>";
+    log += "</log>";
+
+    /// Subtrees come as soon as their buffers are read
+    {
+        Executor ex;
+        BufferQueue q(ex);
+        SubtreeStream s = parse_subtrees(q, "/log/entry");
+        String ids;
+        Task t = collect(s, ids);
+
+        std::string first = log.substr(0, log.find("<entry id=\"3\""));
+        q.push(first.data(), first.size());
+        ex.run();
+        check(ids == String("012") && !t.is_done(), "Async partial");
+
+        q.push(log.data() + first.size(), log.size() - first.size());
+        q.close();
+        ex.run();
+        check(ids == String("0123456789") && t.is_done() && \
+              s.get_error() == PARSE_OK, "Async complete");
+    }
+
+    /// Two documents interleaved on one executor
+    {
+        Executor ex;
+        BufferQueue a(ex), b(ex);
+        SubtreeStream sa = parse_subtrees(a, "/log/entry"),
+            sb = parse_subtrees(b, "/log/entry");
+        String ia, ib;
+        Task ta = collect(sa, ia), tb = collect(sb, ib);
+
+        for (size_t i = 0; i < log.size(); i += 7)
+        {
+            std::string part = log.substr(i, 7);
+            a.push(part.data(), part.size());
+            b.push(part.data(), part.size());
+            ex.run();
+        }
+        a.close();
+        b.close();
+        ex.run();
+        check(ta.is_done() && tb.is_done() && ia == ib && \
+              ia == String("0123456789"), "Async interleaved");
+    }
+
+    /// Errors end the stream
+    {
+        Executor ex;
+        BufferQueue q(ex), r(ex);
+        SubtreeStream s = parse_subtrees(q, "/log/entry"),
+            u = parse_subtrees(r, "/log/entry");
+        String ids, rest;
+        Task t = collect(s, ids), v = collect(u, rest);
+
+        push_chunks(q, ex, "<log><entry id=\"1\"></entry><entry></log>", 5);
+        check(t.is_done() && ids == String("1") && \
+              s.get_error() == UNBALANCED_TAG, "Async malformed");
+
+        push_chunks(r, ex, "<log><entry id=\"1\"></entry>", 5);
+        r.close();
+        ex.run();
+        check(v.is_done() && rest == String("1") && \
+              u.get_error() == UNBALANCED_TAG, "Async truncated");
+
+        BufferQueue e(ex);
+        SubtreeStream empty = parse_subtrees(e, "/log/entry");
+        String none;
+        Task w = collect(empty, none);
+        push_chunks(e, ex, " \n", 5);
+        e.close();
+        ex.run();
+        check(w.is_done() && none.is_empty() && \
+              empty.get_error() == UNBALANCED_TAG, "Async empty input");
+    }
+
+    /// Query outlives the string it was given in
+    {
+        Executor ex;
+        BufferQueue q(ex);
+        std::string query("/log/entry");
+        SubtreeStream s = parse_subtrees(q, query.c_str());
+        query.assign(query.size(), '!');
+        String ids;
+        Task t = collect(s, ids);
+        push_chunks(q, ex, log, 64);
+        q.close();
+        ex.run();
+        check(t.is_done() && s.get_error() == PARSE_OK && \
+              ids == String("0123456789"), "Async query copy");
+    }
+
+    /// Collected subtrees do not stay in parser budget
+    {
+        std::string big("<log>");
+        for (int i = 0; i < 3000; i++)
+            big += "<entry id=\"" + std::to_string(i % 10) + "\"><m>text</m></entry>";
+        big += "</log>";
+
+        Executor ex;
+        BufferQueue q(ex);
+        SubtreeStream s = parse_subtrees(q, "/log/entry", 1 << 16);
+        String ids;
+        Task t = collect(s, ids);
+        push_chunks(q, ex, big, 1000);
+        q.close();
+        ex.run();
+        check(t.is_done() && s.get_error() == PARSE_OK && \
+              ids.get_length() == 3000, "Async memory budget");
+    }
+
+    /// Streams destroyed while parsing waits for input
+    {
+        Executor ex;
+        BufferQueue q(ex), r(ex);
+        String ids, rest;
+        {
+            SubtreeStream s = parse_subtrees(q, "/log/entry"),
+                u = parse_subtrees(r, "/log/entry");
+            Task t = collect(s, ids), v = collect(u, rest);
+            push_chunks(q, ex, log.substr(0, 40), 40);
+            push_chunks(r, ex, log.substr(0, 40), 40);
+
+            /// Second parser is scheduled but not resumed yet
+            r.push(log.data() + 40, 10);
+        }
+        q.push(log.data() + 40, log.size() - 40);
+        ex.run();
+        check(ids == String("0") && rest == String("0"),
+              "Async early destruction");
+
+        /// Consumer gone before its stream
+        BufferQueue w(ex);
+        SubtreeStream s = parse_subtrees(w, "/log/entry");
+        String first, others;
+        {
+            Task t = collect(s, first);
+            push_chunks(w, ex, log.substr(0, 40), 40);
+        }
+        w.push(log.data() + 40, log.size() - 40);
+        w.close();
+        ex.run();
+        Task t = collect(s, others);
+        check(t.is_done() && s.get_error() == PARSE_OK && \
+              first == String("0") && others == String("123456789"),
+              "Async consumer destruction");
+    }
+
+    return failed;
+}
@@ -0,0 +1,145 @@
+#ifndef QWE_CHECKPOINT_H
+#define QWE_CHECKPOINT_H
+
+#include <limits.h>
+#include <string.h>
+#include "qwestring.hpp"
+
+namespace qwe {
+    /**
+     * Appends parser state to checkpoint blob.
+     *
+     * Blob is a sequence of numbers and strings. Numbers are written
+     * in 7-bit groups, low ones first, so small numbers take one
+     * byte; strings are prefixed with their length.
+     *
+     * @see XmlParser::save()
+     */
+    class CheckpointWriter {
+    private:
+        String &out;
+    public:
+        CheckpointWriter(String &s)
+            :out(s)
+        {}
+
+        void put_number(unsigned long n)
+        {
+            while (n >= 0x80)
+            {
+                out.append((char)((n & 0x7F) | 0x80));
+                n >>= 7;
+            }
+            out.append((char)(n));
+        }
+
+        void put_chars(const char *s, size_t n)
+        {
+            put_number(n);
+            out.append(s, n);
+        }
+
+        void put_string(String &s)
+        {
+            put_chars(s.get_data(), s.get_length());
+        }
+    };
+
+    /**
+     * Reads state written by CheckpointWriter.
+     *
+     * Reading past the end of blob or a value out of expected range
+     * marks reader as failed; failed reader returns zeros and empty
+     * strings, so callers may check for errors once at the end.
+     */
+    class CheckpointReader {
+    private:
+        const unsigned char *p;
+        const unsigned char *end;
+        bool failed;
+    public:
+        CheckpointReader(const char *s, size_t n)
+            :p((const unsigned char *)(s)), end(p + n), failed(false)
+        {}
+
+        /**
+         * Read number which must not exceed @a max.
+         */
+        unsigned long get_number(unsigned long max = ULONG_MAX)
+        {
+            unsigned long n = 0;
+            int shift = 0;
+            while (!failed)
+            {
+                if (p == end || shift > 63)
+                {
+                    failed = true;
+                    break;
+                }
+                unsigned char c = *p++;
+                n |= (unsigned long)(c & 0x7F) << shift;
+                shift += 7;
+                if (!(c & 0x80))
+                {
+                    if (n > max)
+                        failed = true;
+                    break;
+                }
+            }
+            return failed ? 0 : n;
+        }
+
+        bool get_flag(void)
+        {
+            return get_number(1) != 0;
+        }
+
+        /**
+         * Read at most @a max characters into @a s.
+         *
+         * @return Number of characters read.
+         */
+        size_t get_chars(char *s, size_t max)
+        {
+            size_t n = get_number(max);
+            if (failed || (size_t)(end - p) < n)
+            {
+                failed = true;
+                return 0;
+            }
+            memcpy(s, p, n);
+            p += n;
+            return n;
+        }
+
+        /**
+         * Replace contents of @a s with string read.
+         */
+        void get_string(String &s)
+        {
+            size_t n = get_number();
+            s = "";
+            if (failed || (size_t)(end - p) < n)
+            {
+                failed = true;
+                return;
+            }
+            s.append((const char *)(p), n);
+            p += n;
+        }
+
+        bool is_failed(void)
+        {
+            return failed;
+        }
+
+        /**
+         * True if the whole blob has been read.
+         */
+        bool is_finished(void)
+        {
+            return p == end;
+        }
+    };
+}
+#endif
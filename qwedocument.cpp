@@ -0,0 +1,56 @@
+#include "qwedocument.hpp"
+
+namespace qwe {
+    /**
+     * Hash of the top element is computed last, which caches hashes
+     * of all elements below it too.
+     */
+    Document::Document(ElementNode *e)
+        :element(e), references(1)
+    {
+        _prepare(element);
+        element->get_hash();
+    }
+
+    /**
+     * Freed tree is not charged to any account, since the last reader
+     * may run inside a scope of unrelated parser.
+     */
+    Document::~Document(void)
+    {
+        MemoryScope scope(0);
+        element->release();
+    }
+
+    /**
+     * Attribute and children counts are enough to build raw markup.
+     */
+    void Document::_prepare(ElementNode *e)
+    {
+        e->get_attributes_count();
+        int n = e->get_children_count();
+        for (int i = 0; i < n; i++)
+        {
+            XmlNode *c = e->get_child(i);
+            if (c->get_type() == ELEMENT_NODE)
+                _prepare((ElementNode *)(c));
+        }
+    }
+
+    Document* Document::acquire(void)
+    {
+        references.fetch_add(1, std::memory_order_relaxed);
+        return this;
+    }
+
+    void Document::release(void)
+    {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    ElementNode* Document::top(void)
+    {
+        return element;
+    }
+}
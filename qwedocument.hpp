@@ -0,0 +1,71 @@
+#ifndef QWE_DOCUMENT_H
+#define QWE_DOCUMENT_H
+#include <atomic>
+#include "qwexml.hpp"
+
+namespace qwe {
+    /**
+     * Immutable document which may be read by many threads at once.
+     *
+     * Document is made from a finished tree (see XmlParser::freeze()).
+     * Everything built lazily (raw attributes and children) is built
+     * and structural hashes are computed beforehand, so afterwards
+     * no read accessor changes any node. Without locks, threads may:
+     *
+     * - traverse the tree with children and attribute accessors and
+     *   iterators, find_attribute(), get_name(), get_contents();
+     *
+     * - evaluate and match queries (compiled Query objects keep no
+     *   state between calls and may be shared too);
+     *
+     * - print nodes, get_hash() and equals().
+     *
+     * Methods which change nodes, including XmlNode::share() and
+     * XmlNode::release(), must not be called on document nodes.
+     *
+     * Document is reference-counted with an atomic counter: each
+     * reader takes a reference with acquire() and drops it with
+     * release(). The whole tree is freed at once by whichever thread
+     * releases the last reference.
+     */
+    class Document {
+    private:
+        ElementNode *element;
+
+        std::atomic <int> references;
+
+        /**
+         * Build everything lazy in subtree of @a e.
+         */
+        static void _prepare(ElementNode *e);
+
+        ~Document(void);
+
+        Document(const Document &d);
+        Document& operator =(const Document &d);
+    public:
+        /**
+         * Takes over completed tree with top-level element @a e,
+         * holding one reference for the caller.
+         */
+        Document(ElementNode *e);
+
+        /**
+         * Take one more reference to document.
+         *
+         * @return This document.
+         */
+        Document* acquire(void);
+
+        /**
+         * Drop reference, freeing the tree if it was the last one.
+         */
+        void release(void);
+
+        /**
+         * Top-level element of document.
+         */
+        ElementNode* top(void);
+    };
+}
+#endif
@@ -0,0 +1,266 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <utility>
+#include "qwedriver.hpp"
+
+namespace qwe {
+    StreamHandler::~StreamHandler(void)
+    {}
+
+    void StreamHandler::on_data(int, XmlParser *)
+    {}
+
+    StreamDriver::StreamDriver(ParserPool *p, size_t size)
+        :pool(p), buffer_size(size), budget(0), count(0)
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    StreamDriver::~StreamDriver(void)
+    {
+        for (int i = 0; i < streams.get_length(); i++)
+            if (streams[i])
+            {
+                pool->release(streams[i]->parser);
+                delete[] streams[i]->buffer;
+                delete streams[i];
+            }
+        for (int i = 0; i < removed.get_length(); i++)
+            delete removed[i];
+        for (int i = 0; i < buffers.get_length(); i++)
+            delete[] buffers[i];
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+    }
+
+    bool StreamDriver::is_open(void)
+    {
+        return epoll_fd >= 0;
+    }
+
+    void StreamDriver::set_feed_budget(size_t bytes)
+    {
+        budget = bytes;
+    }
+
+    char* StreamDriver::take_buffer(void)
+    {
+        if (buffers.is_empty())
+            return new char[buffer_size];
+        char *b = buffers.last_item();
+        buffers.pop_item();
+        return b;
+    }
+
+    void StreamDriver::give_buffer(char *b)
+    {
+        buffers.push_item(b);
+    }
+
+    /**
+     * Streams are level-triggered, so data left in descriptor is
+     * reported again by the next poll.
+     */
+    bool StreamDriver::add_stream(int fd, StreamHandler *h)
+    {
+        if (fd < 0 || epoll_fd < 0)
+            return false;
+        while (streams.get_length() <= fd)
+            streams.push_item(0);
+        if (streams[fd])
+            return false;
+
+        Stream *s = new Stream();
+        s->fd = fd;
+        s->handler = h;
+        s->buffer = 0;
+        s->begin = s->end = 0;
+
+        struct epoll_event e;
+        e.events = EPOLLIN;
+        e.data.ptr = s;
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || \
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &e) < 0)
+        {
+            delete s;
+            return false;
+        }
+
+        s->parser = pool->acquire();
+        streams[fd] = s;
+        count++;
+        return true;
+    }
+
+    void StreamDriver::detach(Stream *s)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, 0);
+        streams[s->fd] = 0;
+        count--;
+        if (s->buffer)
+        {
+            give_buffer(s->buffer);
+            s->buffer = 0;
+        }
+        removed.push_item(s);
+    }
+
+    bool StreamDriver::remove_stream(int fd)
+    {
+        if (fd < 0 || fd >= streams.get_length() || !streams[fd])
+            return false;
+        Stream *s = streams[fd];
+        detach(s);
+        pool->release(s->parser);
+        s->parser = 0;
+        return true;
+    }
+
+    /**
+     * Parser is given back to pool only after handler returns.
+     */
+    void StreamDriver::end_stream(Stream *s, int error)
+    {
+        detach(s);
+        s->handler->on_end(s->fd, s->parser, error);
+        pool->release(s->parser);
+        s->parser = 0;
+    }
+
+    XmlParser* StreamDriver::get_parser(int fd)
+    {
+        if (fd < 0 || fd >= streams.get_length() || !streams[fd])
+            return 0;
+        return streams[fd]->parser;
+    }
+
+    int StreamDriver::get_stream_count(void)
+    {
+        return count;
+    }
+
+    void StreamDriver::read_stream(Stream *s)
+    {
+        char *b = take_buffer();
+        ssize_t n;
+        do
+            n = read(s->fd, b, buffer_size);
+        while (n < 0 && errno == EINTR);
+
+        if (n > 0)
+        {
+            s->buffer = b;
+            s->begin = 0;
+            s->end = n;
+            feed_stream(s);
+            return;
+        }
+        give_buffer(b);
+        if (n == 0)
+            end_stream(s, 0);
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            end_stream(s, errno);
+    }
+
+    /**
+     * Tokens are read one at a time, so that feeding stops where the
+     * top element closes. The document is handed to handler and the
+     * rest of buffer goes to the reset parser as the next document.
+     */
+    void StreamDriver::feed_stream(Stream *s)
+    {
+        XmlParser *p = s->parser;
+        size_t length = s->end - s->begin;
+        if (budget && length > budget)
+            length = budget;
+        MemoryBuffer data(s->buffer + s->begin, length);
+        std::istream in(&data);
+        feed_status status = FEED_OK;
+        bool notified = false;
+
+        while (status != FEED_ERROR && data.in_avail() > 0)
+        {
+            status = p->feed(in, 0, 1);
+            notified = false;
+            if (status == FEED_ERROR || !p->top() || !p->is_finished())
+                continue;
+
+            s->handler->on_data(s->fd, p);
+            /// Handler may have removed stream and its buffer
+            if (!s->parser)
+                return;
+            notified = true;
+            /// Document not taken by handler is dropped
+            delete p->take_top();
+            /// Whitespace between documents belongs to none of them
+            while (data.in_avail() > 0 && isspace(data.sgetc()))
+                data.sbumpc();
+        }
+        s->begin += length - data.in_avail();
+
+        if (status == FEED_ERROR)
+        {
+            end_stream(s, 0);
+            return;
+        }
+        if (s->begin < s->end)
+            held.push_item(s);
+        else
+        {
+            give_buffer(s->buffer);
+            s->buffer = 0;
+        }
+        if (!notified)
+            s->handler->on_data(s->fd, p);
+    }
+
+    /**
+     * Held streams are fed first and skip their readiness events
+     * until their buffers are fed, so that data keeps its order.
+     */
+    int StreamDriver::poll(int timeout)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        if (!held.is_empty())
+            timeout = 0;
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                return -1;
+            n = 0;
+        }
+
+        int served = 0;
+        Vector <Stream *> round(std::move(held));
+        for (int i = 0; i < round.get_length(); i++)
+            if (round[i]->parser)
+            {
+                feed_stream(round[i]);
+                served++;
+            }
+        for (int i = 0; i < n; i++)
+        {
+            Stream *s = (Stream *)(events[i].data.ptr);
+            if (!s->parser || s->buffer)
+                continue;
+            read_stream(s);
+            served++;
+        }
+
+        /// Streams removed by handlers may still be held
+        Vector <Stream *> live;
+        for (int i = 0; i < held.get_length(); i++)
+            if (held[i]->parser)
+                live.push_item(held[i]);
+        held = std::move(live);
+        for (int i = 0; i < removed.get_length(); i++)
+            delete removed[i];
+        removed.clear();
+        return served;
+    }
+}
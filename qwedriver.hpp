@@ -0,0 +1,196 @@
+#ifndef QWE_DRIVER_H
+#define QWE_DRIVER_H
+#include "qwepool.hpp"
+
+namespace qwe {
+    /**
+     * Per-stream callbacks of StreamDriver.
+     */
+    class StreamHandler {
+    public:
+        virtual ~StreamHandler(void);
+
+        /**
+         * Called when top element of a document closes and after a
+         * portion of stream has been fed to parser.
+         *
+         * Handler may take finished document with
+         * XmlParser::take_top(). Document left in parser is dropped
+         * before the next one of the stream is fed.
+         */
+        virtual void on_data(int fd, XmlParser *p);
+
+        /**
+         * Called when stream has ended or failed, after it has been
+         * removed from driver. Parser is still valid until return; its
+         * error tells whether document was malformed. Handler may
+         * close the descriptor.
+         *
+         * @param fd Descriptor of stream.
+         *
+         * @param error Value of @c errno if reading failed, 0 at the
+         * end of stream and on parse errors.
+         */
+        virtual void on_end(int fd, XmlParser *p, int error) = 0;
+    };
+
+    /**
+     * Driver feeding many non-blocking streams to parsers as epoll
+     * reports them readable.
+     *
+     * Each stream is a file descriptor (pipe, socket) with a parser
+     * acquired from a ParserPool and a StreamHandler. When a
+     * descriptor becomes readable, one block is read into a buffer
+     * taken from the driver buffer pool and fed to its parser. With a
+     * feed budget, at most that many bytes are fed per stream in one
+     * poll() and the rest is kept in the buffer for the following
+     * polls, so one fast stream does not delay the others. Buffers
+     * go back to pool as soon as they have been fed, so memory is
+     * proportional to the number of streams with unfed data, not
+     * to the number of streams.
+     *
+     * A stream may carry several documents one after another,
+     * optionally separated by whitespace. Feeding stops where top
+     * element closes, so each document is handed to handler before
+     * the next one is parsed.
+     *
+     * Driver is not thread-safe; it is meant to be run by one event
+     * loop thread. Descriptors are not owned by driver.
+     */
+    class StreamDriver {
+    private:
+        struct Stream {
+            int fd;
+            XmlParser *parser;
+            StreamHandler *handler;
+
+            /**
+             * Buffer holding data not fed yet, 0 if there is none.
+             */
+            char *buffer;
+            size_t begin;
+            size_t end;
+        };
+
+        enum {MAX_EVENTS = 64};
+
+        int epoll_fd;
+
+        ParserPool *pool;
+
+        size_t buffer_size;
+
+        size_t budget;
+
+        /**
+         * Streams indexed by descriptor, 0 for unused descriptors.
+         */
+        Vector <Stream *> streams;
+
+        int count;
+
+        /**
+         * Streams with data left by feed budget.
+         */
+        Vector <Stream *> held;
+
+        /**
+         * Streams removed during poll(), freed when it ends, since
+         * epoll events may still point to them.
+         */
+        Vector <Stream *> removed;
+
+        /**
+         * Free read buffers.
+         */
+        Vector <char *> buffers;
+
+        char* take_buffer(void);
+
+        void give_buffer(char *b);
+
+        /**
+         * Read one block from stream.
+         */
+        void read_stream(Stream *s);
+
+        /**
+         * Feed buffered data of stream, keeping data above budget and
+         * handing finished documents to handler.
+         */
+        void feed_stream(Stream *s);
+
+        /**
+         * Remove stream and pass the end to its handler.
+         */
+        void end_stream(Stream *s, int error);
+
+        /**
+         * Detach stream from epoll and tables, giving its buffer back.
+         */
+        void detach(Stream *s);
+
+        StreamDriver(const StreamDriver &d);
+        StreamDriver& operator =(const StreamDriver &d);
+    public:
+        /**
+         * @param p Pool parsers are acquired from, not owned by
+         * driver.
+         *
+         * @param size Size of read buffers.
+         */
+        StreamDriver(ParserPool *p, size_t size = 4096);
+
+        /**
+         * Streams still added are released without calling their
+         * handlers.
+         */
+        ~StreamDriver(void);
+
+        /**
+         * True if epoll instance has been created.
+         */
+        bool is_open(void);
+
+        /**
+         * Limits bytes fed to each stream in one poll(), 0 (default)
+         * for no limit. Budget smaller than buffer size bounds the
+         * time spent on one stream before others are served.
+         */
+        void set_feed_budget(size_t bytes);
+
+        /**
+         * Starts reading descriptor @a fd, which is switched to
+         * non-blocking mode.
+         *
+         * @return False if descriptor is already added or epoll
+         * refused it.
+         */
+        bool add_stream(int fd, StreamHandler *h);
+
+        /**
+         * Stops reading descriptor without calling its handler.
+         * Parser goes back to pool.
+         *
+         * @return False if descriptor has not been added.
+         */
+        bool remove_stream(int fd);
+
+        /**
+         * Parser of stream @a fd, or 0.
+         */
+        XmlParser* get_parser(int fd);
+
+        int get_stream_count(void);
+
+        /**
+         * Wait up to @a timeout milliseconds (-1 for no limit) for
+         * readable streams and feed them. Streams with data kept by
+         * feed budget are fed without waiting.
+         *
+         * @return Number of streams served, -1 if waiting failed.
+         */
+        int poll(int timeout);
+    };
+}
+#endif
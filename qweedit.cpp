@@ -0,0 +1,166 @@
+#include <utility>
+#include "qweedit.hpp"
+
+namespace qwe {
+    EditableDocument::EditableDocument(void)
+        :element(0)
+    {}
+
+    EditableDocument::~EditableDocument(void)
+    {
+        delete element;
+    }
+
+    ElementNode* EditableDocument::_parse(const char *s, size_t n,
+                                          unsigned long base, RangeList &r)
+    {
+        XmlParser p;
+        p.record_ranges(&r);
+        MemoryBuffer buffer(s, n);
+        std::istream in(&buffer);
+        p.feed(in);
+        ElementNode *e = p.take_top();
+
+        for (int i = 0; i < r.get_length(); i++)
+        {
+            r[i].begin += base;
+            r[i].end += base;
+        }
+        return e;
+    }
+
+    /**
+     * Ranges are sorted by start, so the last range starting before
+     * the edit is found with binary search and enclosing range is
+     * looked for among it and preceding ones. Insertion right before
+     * or after element belongs to its parent.
+     */
+    int EditableDocument::_find_enclosing(unsigned long begin, unsigned long end)
+    {
+        int low = 0, high = ranges.get_length();
+        while (low < high)
+        {
+            int middle = (low + high) / 2;
+            if (ranges[middle].begin <= begin)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        for (int i = low - 1; i >= 0; i--)
+        {
+            ElementRange &r = ranges[i];
+            if (end <= r.end && \
+                (begin != end || (r.begin < begin && begin < r.end)))
+                return i;
+        }
+        return -1;
+    }
+
+    /**
+     * Preceding ranges are either ancestors or end before element.
+     */
+    int EditableDocument::_find_parent(int i)
+    {
+        for (int j = i - 1; j >= 0; j--)
+            if (ranges[j].end >= ranges[i].end)
+                return j;
+        return -1;
+    }
+
+    /**
+     * Range table is rebuilt, since ranges of old and new subtrees
+     * differ in number.
+     */
+    void EditableDocument::_splice(int i, ElementNode *e, RangeList &r, long delta)
+    {
+        ElementNode *old = ranges[i].element;
+        unsigned long old_end = ranges[i].end;
+        int j = i + 1;
+        while (j < ranges.get_length() && ranges[j].begin < old_end)
+            j++;
+
+        ElementNode *parent = (ElementNode *)(old->get_parent());
+        if (parent)
+            parent->replace_child(old, e);
+        else
+            element = e;
+        delete old;
+
+        RangeList updated;
+        for (int k = 0; k < i; k++)
+        {
+            updated.push_item(ranges[k]);
+            if (ranges[k].end >= old_end)
+                updated[k].end += delta;
+        }
+        for (int k = 0; k < r.get_length(); k++)
+            updated.push_item(r[k]);
+        for (int k = j; k < ranges.get_length(); k++)
+        {
+            updated.push_item(ranges[k]);
+            updated[updated.get_length() - 1].begin += delta;
+            updated[updated.get_length() - 1].end += delta;
+        }
+        ranges = std::move(updated);
+    }
+
+    bool EditableDocument::load(const char *s, size_t n)
+    {
+        RangeList r;
+        ElementNode *e = _parse(s, n, 0, r);
+        if (!e)
+            return false;
+
+        delete element;
+        element = e;
+        ranges = std::move(r);
+        text.clear();
+        text.append(s, n);
+        return true;
+    }
+
+    bool EditableDocument::replace(unsigned long begin, unsigned long end,
+                                   const char *s, size_t n)
+    {
+        if (begin > end || end > text.get_length())
+            return false;
+
+        String edited;
+        edited.append(text.get_data(), begin);
+        edited.append(s, n);
+        edited.append(text.get_data() + end, text.get_length() - end);
+        long delta = (long)(n) - (long)(end - begin);
+
+        for (int i = _find_enclosing(begin, end); i >= 0; i = _find_parent(i))
+        {
+            unsigned long from = ranges[i].begin, to = ranges[i].end + delta;
+            RangeList r;
+            ElementNode *e = _parse(edited.get_data() + from, to - from, from, r);
+            if (e)
+            {
+                _splice(i, e, r, delta);
+                text = std::move(edited);
+                return true;
+            }
+        }
+
+        /// Edit is outside of top-level element or breaks it
+        return load(edited.get_data(), edited.get_length());
+    }
+
+    ElementNode* EditableDocument::top(void)
+    {
+        return element;
+    }
+
+    String& EditableDocument::get_text(void)
+    {
+        return text;
+    }
+
+    RangeList& EditableDocument::get_ranges(void)
+    {
+        return ranges;
+    }
+}
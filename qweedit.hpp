@@ -0,0 +1,94 @@
+#ifndef QWE_EDIT_H
+#define QWE_EDIT_H
+#include "qweparse.hpp"
+
+namespace qwe {
+    /**
+     * In-memory document which is updated by textual edits without
+     * parsing it all over again.
+     *
+     * Document keeps its text and byte range of every element (see
+     * XmlParser::record_ranges()). When a range of text is replaced,
+     * only the smallest element enclosing the edit is parsed again
+     * and the new subtree is put in place of the old one. Parents and
+     * siblings of the edited element keep their nodes, so pointers to
+     * them stay valid; pointers into the replaced subtree do not.
+     *
+     * If edited element does not parse as one balanced element any
+     * more, its parent is tried, and so on up to the whole document.
+     */
+    class EditableDocument {
+    private:
+        String text;
+
+        /**
+         * Top-level element, 0 if nothing has been loaded.
+         */
+        ElementNode *element;
+
+        RangeList ranges;
+
+        /**
+         * Parse @a n characters which start at offset @a base of
+         * document, recording ranges into @a r.
+         *
+         * @return Top-level element or 0 if characters are not one
+         * complete element.
+         */
+        static ElementNode* _parse(const char *s, size_t n,
+                                   unsigned long base, RangeList &r);
+
+        /**
+         * Index of the smallest element range containing edit of
+         * range <code>[begin, end)</code>, or -1.
+         */
+        int _find_enclosing(unsigned long begin, unsigned long end);
+
+        /**
+         * Index of range of parent of element with range @a i, or -1.
+         */
+        int _find_parent(int i);
+
+        /**
+         * Replace element with range @a i by @a e and its ranges by
+         * @a r, moving ranges after it by @a delta.
+         */
+        void _splice(int i, ElementNode *e, RangeList &r, long delta);
+
+        EditableDocument(const EditableDocument &d);
+        EditableDocument& operator =(const EditableDocument &d);
+    public:
+        EditableDocument(void);
+
+        ~EditableDocument(void);
+
+        /**
+         * Parse whole document from @a n characters.
+         *
+         * @return False if document is malformed, current contents
+         * are kept then.
+         */
+        bool load(const char *s, size_t n);
+
+        /**
+         * Replace characters in range <code>[begin, end)</code> of
+         * document text with @a n characters of @a s, updating the
+         * tree.
+         *
+         * @return False if range is out of text or edited document is
+         * malformed; document does not change then.
+         */
+        bool replace(unsigned long begin, unsigned long end,
+                     const char *s, size_t n);
+
+        ElementNode* top(void);
+
+        String& get_text(void);
+
+        /**
+         * Ranges of all elements in document order.
+         */
+        RangeList& get_ranges(void);
+    };
+}
+#endif
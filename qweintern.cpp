@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "qweintern.hpp"
+
+namespace qwe {
+    SubtreeCache::SubtreeCache(void)
+        :slots(0), capacity(0), count(0)
+    {}
+
+    SubtreeCache::~SubtreeCache(void)
+    {
+        clear();
+        free(slots);
+        release_memory(capacity * sizeof(Slot));
+    }
+
+    void SubtreeCache::_grow(void)
+    {
+        Slot *old = slots;
+        int old_capacity = capacity;
+
+        int c = capacity ? capacity * 2 : 64;
+        Slot *grown = (Slot *)(calloc(c, sizeof(Slot)));
+        /// Failure is reported like that of operator new, keeping
+        /// the old table
+        if (!grown)
+            throw std::bad_alloc();
+        slots = grown;
+        capacity = c;
+        QWE_STAT(count_alloc(capacity * sizeof(Slot)));
+        charge_memory(capacity * sizeof(Slot));
+
+        for (int i = 0; i < old_capacity; i++)
+            if (old[i].element)
+                *_find(old[i].element, old[i].hash) = old[i];
+        free(old);
+        release_memory(old_capacity * sizeof(Slot));
+    }
+
+    /**
+     * Capacity is a power of two, so linear probing wraps with a
+     * mask. Stored hashes are compared before elements.
+     */
+    SubtreeCache::Slot* SubtreeCache::_find(ElementNode *e, unsigned long h)
+    {
+        int mask = capacity - 1;
+        for (int i = h & mask; ; i = (i + 1) & mask)
+        {
+            Slot *s = slots + i;
+            if (!s->element || (s->hash == h && s->element->equals(e)))
+                return s;
+        }
+    }
+
+    ElementNode* SubtreeCache::intern(ElementNode *e)
+    {
+        if (2 * (count + 1) > capacity)
+            _grow();
+
+        unsigned long h = e->get_hash();
+        Slot *s = _find(e, h);
+        if (!s->element)
+        {
+            s->hash = h;
+            s->element = (ElementNode *)(e->share());
+            count++;
+        }
+        return s->element;
+    }
+
+    void SubtreeCache::clear(void)
+    {
+        for (int i = 0; i < capacity; i++)
+            if (slots[i].element)
+            {
+                slots[i].element->release();
+                slots[i].element = 0;
+            }
+        count = 0;
+    }
+
+    int SubtreeCache::get_count(void)
+    {
+        return count;
+    }
+}
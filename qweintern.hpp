@@ -0,0 +1,73 @@
+#ifndef QWE_INTERN_H
+#define QWE_INTERN_H
+#include "qwexml.hpp"
+
+namespace qwe {
+    /**
+     * Set of shared element subtrees used to store repeated subtrees
+     * only once.
+     *
+     * Cache is an open-addressing hash table keyed by
+     * XmlNode::get_hash() and compared with XmlNode::equals(). It
+     * holds one reference to every cached element, so cached
+     * subtrees live until the cache is cleared even if documents
+     * which used them are freed.
+     *
+     * @see XmlParser::set_subtree_sharing()
+     */
+    class SubtreeCache {
+    private:
+        struct Slot {
+            unsigned long hash;
+            ElementNode *element;
+        };
+
+        /**
+         * Table of SubtreeCache::capacity slots, 0 if empty.
+         */
+        Slot *slots;
+
+        int capacity;
+
+        int count;
+
+        /**
+         * Double the table, keeping it at most half full.
+         */
+        void _grow(void);
+
+        /**
+         * Slot with element equal to @a e or empty slot where it
+         * belongs.
+         */
+        Slot* _find(ElementNode *e, unsigned long h);
+
+        SubtreeCache(const SubtreeCache &c);
+        SubtreeCache& operator =(const SubtreeCache &c);
+    public:
+        SubtreeCache(void);
+
+        /**
+         * Releases all cached elements.
+         */
+        ~SubtreeCache(void);
+
+        /**
+         * Find cached subtree equal to completed element @a e.
+         *
+         * If there is one, it is returned and caller may replace @a
+         * e with it (taking a new reference with XmlNode::share()).
+         * Otherwise @a e itself is added to cache, which shares it,
+         * and returned.
+         */
+        ElementNode* intern(ElementNode *e);
+
+        /**
+         * Release all cached elements, keeping the table.
+         */
+        void clear(void);
+
+        int get_count(void);
+    };
+}
+#endif
@@ -6,11 +6,11 @@
 #include <string>
 
 #include <stddef.h>
+#include "qwestats.hpp"
+#include "qwememory.hpp"
 
 /**
  * @todo Use homebrew string implementation.
- *
- * @todo Fix memory leaks.
  */
 
 namespace qwe {
@@ -53,6 +53,19 @@ namespace qwe {
             /// Each list must have unique sentinels
             head_sentinel = new ListItem();
             tail_sentinel = new ListItem();
+            QWE_STAT(count_alloc(2 * sizeof(ListItem)));
+            charge_memory(2 * sizeof(ListItem));
+        }
+
+        void _free_sentinels(void)
+        {
+            /// Moved-from list has no sentinels
+            if (head_sentinel)
+            {
+                delete head_sentinel;
+                delete tail_sentinel;
+                release_memory(2 * sizeof(ListItem));
+            }
         }
     public:
         /**
@@ -151,7 +164,7 @@ namespace qwe {
         };
 
         List(void)
-            :head(0), tail(0)
+            :head(0), tail(0), length(0)
         {
             _init_sentinels();
         }
@@ -159,13 +172,42 @@ namespace qwe {
         ~List(void)
         {
             clear();
+            _free_sentinels();
+        }
 
-            delete head_sentinel;
-            delete tail_sentinel;
+        /**
+         * Takes over cells of @a l without allocating.
+         *
+         * @a l may only be destroyed or assigned to afterwards.
+         */
+        List(List &&l)
+            :head(l.head), tail(l.tail),
+             head_sentinel(l.head_sentinel), tail_sentinel(l.tail_sentinel),
+             length(l.length)
+        {
+            l.head = l.tail = l.head_sentinel = l.tail_sentinel = 0;
+            l.length = 0;
+        }
+
+        List& operator =(List &&l)
+        {
+            if (this != &l)
+            {
+                clear();
+                _free_sentinels();
+                head = l.head;
+                tail = l.tail;
+                head_sentinel = l.head_sentinel;
+                tail_sentinel = l.tail_sentinel;
+                length = l.length;
+                l.head = l.tail = l.head_sentinel = l.tail_sentinel = 0;
+                l.length = 0;
+            }
+            return *this;
         }
 
         List(List &l)
-            :head(0), tail(0)
+            :head(0), tail(0), length(0)
         {
             _init_sentinels();
 
@@ -183,6 +225,8 @@ namespace qwe {
         void push_item(Data d)
         {
             ListItem *n = new ListItem(d);
+            QWE_STAT(count_alloc(sizeof(ListItem)));
+            charge_memory(sizeof(ListItem));
             if (!head)
             {
                 head = tail = n;
@@ -201,7 +245,7 @@ namespace qwe {
         /**
          * Remove last entry from list.
          *
-         * @todo Fix leak
+         * Only list cell is freed, entry itself belongs to caller.
          */
         void pop_item()
         {
@@ -216,6 +260,7 @@ namespace qwe {
                 tail = tail->prev;
             }
             delete l;
+            release_memory(sizeof(ListItem));
             length--;
         }
 
@@ -0,0 +1,122 @@
+#ifndef QWE_MEMORY_H
+#define QWE_MEMORY_H
+
+#include <stddef.h>
+
+namespace qwe {
+    /**
+     * Memory usage of one document with optional budget.
+     *
+     * Strings, list cells and nodes report their allocations to the
+     * account which is current in the calling thread (see
+     * MemoryScope), so the parser knows how much memory its tree and
+     * pending tokens take.
+     */
+    class MemoryAccount {
+    private:
+        size_t used;
+        size_t peak;
+
+        /**
+         * Maximum allowed usage, 0 for unlimited.
+         */
+        size_t budget;
+    public:
+        MemoryAccount(void)
+            :used(0), peak(0), budget(0)
+        {}
+
+        void charge(size_t n)
+        {
+            used += n;
+            if (used > peak)
+                peak = used;
+        }
+
+        /**
+         * Memory allocated before the account became current may be
+         * freed while it is, so usage never goes below zero.
+         */
+        void release(size_t n)
+        {
+            used = (n < used) ? used - n : 0;
+        }
+
+        size_t get_used(void)
+        {
+            return used;
+        }
+
+        size_t get_peak(void)
+        {
+            return peak;
+        }
+
+        size_t get_budget(void)
+        {
+            return budget;
+        }
+
+        void set_budget(size_t n)
+        {
+            budget = n;
+        }
+
+        bool is_exceeded(void)
+        {
+            return budget && used > budget;
+        }
+
+        /**
+         * Start tracking peak usage from current usage.
+         */
+        void reset_peak(void)
+        {
+            peak = used;
+        }
+    };
+
+    /**
+     * Account charged by allocations in current thread, 0 if none.
+     */
+    inline MemoryAccount*& current_account(void)
+    {
+        static thread_local MemoryAccount *account = 0;
+        return account;
+    }
+
+    inline void charge_memory(size_t n)
+    {
+        MemoryAccount *a = current_account();
+        if (a)
+            a->charge(n);
+    }
+
+    inline void release_memory(size_t n)
+    {
+        MemoryAccount *a = current_account();
+        if (a)
+            a->release(n);
+    }
+
+    /**
+     * Makes account current for the lifetime of scope object,
+     * restoring previous one afterwards.
+     */
+    class MemoryScope {
+    private:
+        MemoryAccount *saved;
+    public:
+        MemoryScope(MemoryAccount *a)
+        {
+            saved = current_account();
+            current_account() = a;
+        }
+
+        ~MemoryScope(void)
+        {
+            current_account() = saved;
+        }
+    };
+}
+#endif
@@ -1,43 +1,208 @@
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <utility>
+#ifdef QWE_STATS
+#include <time.h>
+#endif
 #include "qweparse.hpp"
 
 namespace qwe {
+#ifdef QWE_STATS
+    /**
+     * Monotonic time in nanoseconds.
+     */
+    static unsigned long long now_ns(void)
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (unsigned long long)(t.tv_sec) * 1000000000ULL + t.tv_nsec;
+    }
+
+    ParserStats::ParserStats(void)
+    {
+        clear();
+    }
+
+    void ParserStats::clear(void)
+    {
+        for (int i = 0; i < TOKEN_TYPES; i++)
+            tokens[i] = bytes[i] = 0;
+        for (int i = 0; i < BUCKETS; i++)
+            name_lengths[i] = text_lengths[i] = attr_lengths[i] = 0;
+        allocations = allocated_bytes = 0;
+        max_depth = 0;
+        feeds = 0;
+        last_lex_ns = last_build_ns = lex_ns = build_ns = 0;
+    }
+
+    void ParserStats::record(unsigned long *histogram, size_t length)
+    {
+        int bucket = 0;
+        while (length && bucket < BUCKETS - 1)
+        {
+            length >>= 1;
+            bucket++;
+        }
+        histogram[bucket]++;
+    }
 
     /**
-     * Produce error message and exit with error code.
-     *
-     * @todo Use exceptions instead of this.
+     * Write cumulative histogram with upper bounds of buckets in
+     * @c le labels.
      */
-    void error(error_type n)
+    static void export_histogram(unsigned long *histogram, std::ostream &o,
+                                 const char *prefix, const char *name)
+    {
+        unsigned long total = 0;
+        for (int i = 0; i < ParserStats::BUCKETS - 1; i++)
+        {
+            total += histogram[i];
+            o << prefix << "_" << name << "_bucket{le=\"" \
+              << ((1UL << i) - 1) << "\"} " << total << "\n";
+        }
+        total += histogram[ParserStats::BUCKETS - 1];
+        o << prefix << "_" << name << "_bucket{le=\"+Inf\"} " << total << "\n";
+        o << prefix << "_" << name << "_count " << total << "\n";
+    }
+
+    void export_stats(ParserStats &s, std::ostream &o, const char *prefix)
+    {
+        static const char *names[TOKEN_TYPES] =
+            {"none", "tag", "space", "text", "pi", "skip",
+             "comment", "cdata", "doctype"};
+
+        for (int i = 1; i < TOKEN_TYPES; i++)
+        {
+            o << prefix << "_tokens_total{type=\"" << names[i] << "\"} " \
+              << s.tokens[i] << "\n";
+            o << prefix << "_token_bytes_total{type=\"" << names[i] << "\"} " \
+              << s.bytes[i] << "\n";
+        }
+        o << prefix << "_allocations_total " << s.allocations << "\n";
+        o << prefix << "_allocated_bytes_total " << s.allocated_bytes << "\n";
+        o << prefix << "_max_depth " << s.max_depth << "\n";
+        o << prefix << "_feeds_total " << s.feeds << "\n";
+        o << prefix << "_lex_seconds_total " << s.lex_ns / 1e9 << "\n";
+        o << prefix << "_build_seconds_total " << s.build_ns / 1e9 << "\n";
+        o << prefix << "_last_feed_lex_seconds " << s.last_lex_ns / 1e9 << "\n";
+        o << prefix << "_last_feed_build_seconds " << s.last_build_ns / 1e9 << "\n";
+        export_histogram(s.name_lengths, o, prefix, "name_length");
+        export_histogram(s.text_lengths, o, prefix, "text_length");
+        export_histogram(s.attr_lengths, o, prefix, "attribute_length");
+    }
+#endif
+
+    const char* error_message(error_type n)
     {
         switch (n)
         {
+        case PARSE_OK:
+            return "No error";
         case TAG_ERROR:
-            std::cout << "Error while reading tag" << std::endl;
-            exit(TAG_ERROR);
+            return "Error while reading tag";
         case UNKNOWN_TOKEN:
-            std::cout << "Could not choose appropriate token" << std::endl;
-            exit(UNKNOWN_TOKEN);
+            return "Could not choose appropriate token";
         case UNBALANCED_TAG:
-            std::cout << "Unbalanced opening and closing tags" << std::endl;
-            exit(UNBALANCED_TAG);
+            return "Unbalanced opening and closing tags";
         case UNEXPECTED_CLOSE:
-            std::cout << "Unexpected closing tag" << std::endl;
-            exit(UNEXPECTED_CLOSE);
+            return "Unexpected closing tag";
         case MULTI_TOP:
-            std::cout << "Multiple root elements" << std::endl;
-            exit(MULTI_TOP);
+            return "Multiple root elements";
         case PI_ERROR:
-            std::cout << "Error while reading PI" << std::endl;
-            exit(PI_ERROR);
+            return "Error while reading PI";
+        case ENTITY_ERROR:
+            return "Malformed entity reference";
+        case DECL_ERROR:
+            return "Error while reading comment, CDATA or DOCTYPE";
+        case MEMORY_LIMIT:
+            return "Memory budget exceeded";
         }
+        return "Unknown error";
+    }
+
+    ParseError::ParseError(void)
+    {
+        clear();
+    }
+
+    void ParseError::clear(void)
+    {
+        type = PARSE_OK;
+        offset = 0;
+        line = 1;
+        column = 1;
+        depth = 0;
     }
 
+    Token::~Token(void)
+    {}
+
     void Token::flush(void)
     {
         contents = "";
         finished = false;
+        consumed = 0;
+        newlines = 0;
+        line_start = 0;
+        failure = PARSE_OK;
+    }
+
+    unsigned long Token::get_consumed(void)
+    {
+        return consumed;
+    }
+
+    unsigned long Token::get_newlines(void)
+    {
+        return newlines;
+    }
+
+    unsigned long Token::get_line_start(void)
+    {
+        return line_start;
+    }
+
+    error_type Token::get_error(void)
+    {
+        return failure;
+    }
+
+    void Token::save(CheckpointWriter &w)
+    {
+        w.put_string(contents);
+        w.put_number(consumed);
+        w.put_number(newlines);
+        w.put_number(line_start);
+    }
+
+    bool Token::restore(CheckpointReader &r)
+    {
+        r.get_string(contents);
+        consumed = r.get_number();
+        newlines = r.get_number();
+        line_start = r.get_number(consumed);
+        return !r.is_failed();
+    }
+
+    void Token::advance(const char *s, size_t n)
+    {
+        const char *end = s + n, *p = s;
+        while ((p = (const char *)(memchr(p, '\n', end - p))))
+        {
+            newlines++;
+            p++;
+            line_start = consumed + (p - s);
+        }
+        consumed += n;
+    }
+
+    bool Token::fail(error_type e)
+    {
+        failure = e;
+        return false;
     }
 
     String& Token::get_contents(void)
@@ -61,7 +226,8 @@ namespace qwe {
      */
     std::istream& operator >>(std::istream &in, Token &t)
     {
-        t.feed(in);
+        if (!t.feed(in))
+            in.setstate(std::ios::failbit);
         return in;
     }
 
@@ -80,10 +246,14 @@ namespace qwe {
         return (is_xmltext(c) && !(c == '"'));
     }
 
+    /**
+     * Bytes above 0x7F are parts of UTF-8 sequences and accepted as
+     * is.
+     */
     bool is_xmltext(char c)
     {
-        return ((isgraph(c) || isspace(c)) &&   \
-                !((c == '<') || (c == '&')));
+        return ((unsigned char)(c) > 0x7F ||
+                ((isgraph(c) || isspace(c)) && !(c == '<')));
     }
 
     bool is_picontent(char c)
@@ -91,34 +261,55 @@ namespace qwe {
         return is_xmltext(c) && !((c == '?') || (c == '>'));
     }
 
+    /**
+     * Element of closing tag is reused for the next tag, element of
+     * opening tag which was not taken is freed.
+     */
     void TagToken::flush(void)
     {
         Token::flush();
         current_state = START;
+        value_entity.flush();
+        current_key = "";
+        current_value = "";
 
-        /// @todo Fix leaks
-        element = new ElementNode();
+        if (element && closing)
+            element->set_name("");
+        else
+        {
+            delete element;
+            element = 0;
+        }
 
         closing = false;
         empty = false;
+        attributes_read = false;
     }
 
     TagToken::TagToken(void)
+        :element(0), lazy(false)
     {
         type = TAG;
         flush();
     }
 
     TagToken::TagToken(TagToken &t)
+        :element(0), lazy(t.lazy)
     {
         type = TAG;
         flush();
         contents = t.contents;
         element = t.element;
+        t.element = 0;
         closing = t.closing;
         empty = t.empty;
     }
 
+    TagToken::~TagToken(void)
+    {
+        delete element;
+    }
+
     TagToken* TagToken::copy(void)
     {
         return new TagToken(*this);
@@ -129,6 +320,13 @@ namespace qwe {
         return element;
     }
 
+    ElementNode* TagToken::take_element(void)
+    {
+        ElementNode *e = element;
+        element = 0;
+        return e;
+    }
+
     bool TagToken::is_closing(void)
     {
         return closing;
@@ -139,16 +337,85 @@ namespace qwe {
         return empty;
     }
 
+    void TagToken::set_lazy(bool on)
+    {
+        lazy = on;
+    }
+
+    /**
+     * Raw attributes are split when counted, so element is saved
+     * with ordinary attributes.
+     */
+    void TagToken::save(CheckpointWriter &w)
+    {
+        Token::save(w);
+        w.put_number(current_state);
+        w.put_number(closing);
+        w.put_number(empty);
+        w.put_number(attributes_read);
+        w.put_number(element != 0);
+        if (element)
+        {
+            w.put_string(element->get_name());
+            int n = element->get_attributes_count();
+            w.put_number(n);
+            for (int i = 0; i < n; i++)
+            {
+                w.put_string(element->get_attribute(i)->get_name());
+                w.put_string(element->get_attribute(i)->get_value());
+            }
+        }
+        w.put_string(current_key);
+        w.put_string(current_value);
+        value_entity.save(w);
+    }
+
+    bool TagToken::restore(CheckpointReader &r)
+    {
+        Token::restore(r);
+        current_state = (state)(r.get_number(END));
+        closing = r.get_flag();
+        empty = r.get_flag();
+        attributes_read = r.get_flag();
+
+        delete element;
+        element = 0;
+        if (r.get_flag())
+        {
+            element = new ElementNode();
+            r.get_string(element->get_name());
+            unsigned long n = r.get_number();
+            for (unsigned long i = 0; i < n && !r.is_failed(); i++)
+            {
+                String key, value;
+                r.get_string(key);
+                r.get_string(value);
+                element->add_attribute(std::move(key), std::move(value));
+            }
+        }
+        r.get_string(current_key);
+        r.get_string(current_value);
+        value_entity.restore(r);
+        return !r.is_failed();
+    }
+
     bool TagToken::can_eat(std::istream &in)
     {
         return ('<' == in.peek());
     }
 
+    /**
+     * Element is created when the first character of its name is
+     * read.
+     */
     void TagToken::add_to_name(char c)
     {
-        String s = element->get_name();
-        s.append(c);
-        element->set_name(s);
+        if (!element)
+        {
+            element = new ElementNode();
+            QWE_STAT(count_alloc(sizeof(ElementNode)));
+        }
+        element->get_name().append(c);
     }
 
     /**
@@ -166,7 +433,7 @@ namespace qwe {
      *
      * - TagToken::empty.
      *
-     * In case of read errors, error() is called with TAG_ERROR code.
+     * In case of read errors, false is returned with TAG_ERROR code.
      *
      * Tags are read using finite automata according to the following
      * grammar:
@@ -236,6 +503,10 @@ namespace qwe {
         {
             bool accepted = true;
 
+            /// End of stream must not get into name or attributes
+            if (in.eof() && current_state != END)
+                return true;
+
             switch (current_state)
             {
             case START:
@@ -299,14 +570,19 @@ namespace qwe {
                 else if (is_attkey(c))
                 {
                     current_state = KEY;
-                    current_key += c;
+                    attributes_read = true;
+                    if (!lazy)
+                        current_key += c;
                 }
                 else
                     accepted = false;
                 break;
             case KEY:
                 if (is_attkey(c))
-                    current_key += c;
+                {
+                    if (!lazy)
+                        current_key += c;
+                }
                 else if (c == '=')
                     current_state = EQUAL;
                 else
@@ -319,13 +595,24 @@ namespace qwe {
                     accepted = false;
                 break;
             case VALUE:
-                if (is_attval(c))
-                    current_value += c;
+                if (value_entity.is_active())
+                    accepted = value_entity.feed(c, current_value);
+                else if (c == '&')
+                    value_entity.start();
+                else if (is_attval(c))
+                {
+                    if (!lazy)
+                        current_value += c;
+                }
                 else if (c == '"')
                 {
-                    element->add_attribute(current_key, current_value);
-                    current_key = "";
-                    current_value = "";
+                    /// In lazy mode value only collects decoded
+                    /// references
+                    if (lazy)
+                        current_value = "";
+                    else
+                        element->add_attribute(std::move(current_key),
+                                               std::move(current_value));
                     current_state = END_V;
                 }
                 else
@@ -364,11 +651,21 @@ namespace qwe {
                 return true;
 
             if (accepted)
+            {
+                /// Attribute region ends before closing @c >
+                if (current_state == END && lazy && attributes_read)
+                {
+                    size_t skip = 1 + element->get_name().get_length();
+                    element->set_raw_attributes(contents.get_data() + skip,
+                                                contents.get_length() - skip);
+                }
                 contents += c;
+                advance(c);
+            }
             else
-                error(TAG_ERROR);
+                return fail(TAG_ERROR);
         }
-        return false;
+        return fail(TAG_ERROR);
     }
 
     void PiToken::flush(void)
@@ -390,6 +687,19 @@ namespace qwe {
         contents = t.contents;
     }
 
+    void PiToken::save(CheckpointWriter &w)
+    {
+        Token::save(w);
+        w.put_number(current_state);
+    }
+
+    bool PiToken::restore(CheckpointReader &r)
+    {
+        Token::restore(r);
+        current_state = (state)(r.get_number(END));
+        return !r.is_failed();
+    }
+
     PiToken* PiToken::copy(void)
     {
         return new PiToken(*this);
@@ -489,237 +799,1797 @@ namespace qwe {
                 return true;
 
             if (accepted)
+            {
                 contents += c;
+                advance(c);
+            }
             else
-                error(PI_ERROR);
+                return fail(PI_ERROR);
         }
-        return false;
+        return fail(PI_ERROR);
     }
 
-    /**
-     * Return true if character is space between XML nodes.
-     */
-    bool Fis_xmlspace::operator () (char c)
+    void DeclToken::flush(void)
     {
-        return isspace(c);
+        Token::flush();
+        type = NONE;
+        current_state = START;
+        keyword = 0;
+        matched = 0;
+        held = 0;
+        brackets = 0;
+        quote = 0;
     }
 
-    /**
-     * Return true if character may belong to text node.
-     *
-     * @see http://www.w3.org/TR/REC-xml/#dt-chardata
-     */
-    bool Fis_xmltext::operator () (char c)
+    DeclToken::DeclToken(void)
     {
-        return is_xmltext(c);
+        flush();
     }
 
-    XmlLexer::XmlLexer(TokenList *l)
-        :current(0)
+    DeclToken::DeclToken(DeclToken &t)
     {
-        tokens = new TokenList();
-        known = new TokenList(*l);
+        flush();
+        type = t.type;
+        contents = t.contents;
     }
 
-    XmlLexer::~XmlLexer(void)
+    DeclToken* DeclToken::copy(void)
     {
-        qwe::TokenList::StlIterator i, end;
-        i = tokens->begin();
-        end = tokens->end();
+        return new DeclToken(*this);
+    }
 
-        // Free worker tokens
-        while (i != end)
+    void DeclToken::save(CheckpointWriter &w)
+    {
+        Token::save(w);
+        w.put_number(type);
+        w.put_number(current_state);
+        w.put_number(matched);
+        w.put_number(held);
+        w.put_number((unsigned long)(long)(brackets));
+        w.put_number((unsigned char)(quote));
+    }
+
+    bool DeclToken::restore(CheckpointReader &r)
+    {
+        Token::restore(r);
+        type = (token_type)(r.get_number(DOCTYPE));
+        current_state = (state)(r.get_number(END));
+        switch (type)
         {
-            delete *i;
-            i++;
+        case COMMENT:
+            keyword = "--";
+            break;
+        case CDATA:
+            keyword = "[CDATA[";
+            break;
+        case DOCTYPE:
+            keyword = "DOCTYPE";
+            break;
+        default:
+            keyword = 0;
+            break;
         }
+        matched = r.get_number(keyword ? strlen(keyword) : 0);
+        held = r.get_number(2);
+        brackets = (int)(long)(r.get_number());
+        quote = r.get_number(UCHAR_MAX);
+        return !r.is_failed() && (type == NONE || keyword);
+    }
 
-        delete tokens;
-        delete known;
+    bool DeclToken::can_eat(std::istream &in)
+    {
+        char pc, c;
+        pc = in.get();
+        c = in.peek();
+        in.putback(pc);
+
+        return ((pc == '<') && (c == '!'));
     }
 
     /**
-     * Call Token::can_eat() for each known lexer token and pick the
-     * first one which returns true. Tokens are tried in the same
-     * order as in the list which was used to construct lexer.
+     * Blocks are limited to what stream buffer already holds, so
+     * that characters read past terminator can always be put back.
+     * When buffer is empty, sgetc() is called to refill it.
      */
-    Token* XmlLexer::choose_token(std::istream &in)
+    bool DeclToken::scan(std::istream &in, const char *terminator, bool keep)
     {
-        char c;
-        TokenList::StlIterator i, end;
-        i = known->begin();
-        end = known->end();
-        while (i != end)
+        std::streambuf *sb = in.rdbuf();
+        size_t length = strlen(terminator);
+        char block[4096];
+
+        while (true)
         {
-            if ((*i)->can_eat(in))
-                return *i;
-            else
-                i++;
+            std::streamsize avail = sb->in_avail();
+            if (avail <= 0)
+            {
+                if (sb->sgetc() == EOF)
+                    return false;
+                avail = sb->in_avail();
+                /// Unbuffered stream, read one character at a time
+                if (avail <= 0)
+                    avail = 1;
+            }
+            if (avail > (std::streamsize)(sizeof(block) - held))
+                avail = sizeof(block) - held;
+
+            /// Held characters are terminator prefix
+            memcpy(block, terminator, held);
+            size_t fresh = sb->sgetn(block + held, avail);
+            size_t n = held + fresh;
+
+            char *found = (char *)(memmem(block, n, terminator, length));
+            if (found)
+            {
+                size_t end = found - block, rest = n - end - length;
+                if (keep)
+                    contents.append(block, end);
+                for (size_t i = rest; i > 0; i--)
+                    sb->sungetc();
+                advance(block + held, fresh - rest);
+                held = 0;
+                return true;
+            }
+            advance(block + held, fresh);
+
+            /// Hold longest block suffix which may start terminator
+            held = (length - 1 < n) ? length - 1 : n;
+            while (held > 0 && memcmp(block + n - held, terminator, held))
+                held--;
+            if (keep)
+                contents.append(block, n - held);
+        }
+    }
+
+    bool DeclToken::scan_doctype(std::istream &in)
+    {
+        std::streambuf *sb = in.rdbuf();
+        int c;
+
+        while ((c = sb->sbumpc()) != EOF)
+        {
+            advance(c);
+            if (quote)
+            {
+                if (c == quote)
+                    quote = 0;
+            }
+            else if (c == '"' || c == '\'')
+                quote = c;
+            else if (c == '[')
+                brackets++;
+            else if (c == ']')
+                brackets--;
+            else if (c == '>' && brackets == 0)
+                return true;
+            contents += (char)(c);
         }
-        c = in.peek();
-        error(UNKNOWN_TOKEN);
         return false;
     }
 
     /**
-     * Read one token from input stream and add it to XmlLexer::tokens
-     * list.
+     * Read comment, CDATA section or DOCTYPE:
+     *
+     @verbatim
+     Comment ::= '<!--' Char* '-->'
+     CDSect  ::= '<![CDATA[' Char* ']]>'
+     doctypedecl ::= '<!DOCTYPE' ... '>'
+@endverbatim
+     *
+     * Keyword is read character by character, then the body is read
+     * with scan() or scan_doctype().
+     *
+     * @see http://www.w3.org/TR/REC-xml/#sec-comments
+     * @see http://www.w3.org/TR/REC-xml/#sec-cdata-sect
      */
-    bool XmlLexer::feed(std::istream &in)
+    bool DeclToken::feed(std::istream &in)
     {
-        /// Iterators over the list of known tokens
-        TokenList::StlIterator i, end;
-        end = known->end();
-        while (in.peek() != -1)
+        int c;
+
+        while (current_state != BODY)
         {
-            /// If there's no token currently being read, choose the
-            /// next one to consume
-            if (!current)
-                current = choose_token(in);
-            in >> *(current);
+            if ((c = in.peek()) == EOF)
+                return true;
 
-            if (current->is_finished())
+            bool accepted = true;
+            switch (current_state)
             {
-                /// Store copy of fully read token
-                tokens->push_item(current->copy());
-
-                /// Flush worker token
-                current->flush();
-                current = 0;
+            case START:
+                accepted = (c == '<');
+                current_state = OPEN;
+                break;
+            case OPEN:
+                accepted = (c == '!');
+                current_state = KEYWORD;
+                break;
+            case KEYWORD:
+                if (!keyword)
+                {
+                    if (c == '-')
+                    {
+                        keyword = "--";
+                        type = COMMENT;
+                    }
+                    else if (c == '[')
+                    {
+                        keyword = "[CDATA[";
+                        type = CDATA;
+                    }
+                    else if (c == 'D')
+                    {
+                        keyword = "DOCTYPE";
+                        type = DOCTYPE;
+                    }
+                    else
+                    {
+                        accepted = false;
+                        break;
+                    }
+                }
+                else if (c != keyword[matched])
+                {
+                    accepted = false;
+                    break;
+                }
+                if (keyword[++matched] == 0)
+                    current_state = BODY;
+                break;
+            default:
+                break;
             }
+
+            if (!accepted)
+                return fail(DECL_ERROR);
+            in.get();
+            advance(c);
+        }
+
+        switch (type)
+        {
+        case COMMENT:
+            finished = scan(in, "-->", false);
+            break;
+        case CDATA:
+            finished = scan(in, "]]>", true);
+            break;
+        default:
+            finished = scan_doctype(in);
+            break;
         }
+        if (finished)
+            current_state = END;
         return true;
     }
 
-    /**
-     * Wrap XmlLexer::feed() for use with input operator.
-     */
-    std::istream& operator >>(std::istream &in, XmlLexer &l)
+    void SkipToken::flush(void)
     {
-        l.feed(in);
-        return in;
+        Token::flush();
+        current_state = TEXT;
+        depth = 1;
+        closing = 0;
     }
 
-    void XmlLexer::flush(void)
+    SkipToken::SkipToken(void)
+        :keep(false)
     {
-        tokens->clear();
+        type = SKIP;
+        flush();
     }
 
-    TokenList::StlIterator XmlLexer::begin(void)
+    SkipToken::SkipToken(SkipToken &t)
+        :keep(t.keep)
     {
-        return tokens->begin();
+        type = SKIP;
+        flush();
+        contents = t.contents;
+        current_state = t.current_state;
+        depth = t.depth;
+        closing = t.closing;
     }
 
-    TokenList::StlIterator XmlLexer::end(void)
+    void SkipToken::save(CheckpointWriter &w)
     {
-        return tokens->end();
+        Token::save(w);
+        w.put_number(current_state);
+        w.put_number(depth);
+        w.put_number(closing);
+        w.put_number(keep);
     }
 
-    XmlParser::XmlParser(void)
+    bool SkipToken::restore(CheckpointReader &r)
     {
-        /// Setup lexer
-        qwe::TokenList *xml_tokens = new qwe::TokenList();
-        xml_tokens->push_item(new qwe::PiToken());
-        xml_tokens->push_item(new qwe::TagToken());
-        xml_tokens->push_item(new qwe::SpaceToken());
-        xml_tokens->push_item(new qwe::TextToken());
-        lexer = new XmlLexer(xml_tokens);
-
-        stack = new List <TagToken *>;
-        current_node = root = new ElementNode();
+        Token::restore(r);
+        current_state = (state)(r.get_number(CDATA_BODY));
+        depth = r.get_number(INT_MAX);
+        closing = r.get_number(INT_MAX);
+        keep = r.get_flag();
+        return !r.is_failed();
     }
 
-    XmlParser::~XmlParser(void)
+    SkipToken* SkipToken::copy(void)
     {
-        qwe::TokenList::StlIterator i, end;
-        i = lexer->known->begin();
-        end = lexer->known->end();
-
-        // Free worker tokens
-        while (i != end)
-        {
-            delete *i;
-            i++;
-        }
+        return new SkipToken(*this);
+    }
 
-        delete lexer;
+    bool SkipToken::can_eat(std::istream &)
+    {
+        return false;
+    }
+
+    void SkipToken::set_keep(bool on)
+    {
+        keep = on;
+    }
+
+    /**
+     * Skip characters tracking only the number of open elements.
+     * Characters are taken directly from stream buffer. Unless
+     * SkipToken::keep is set, nothing is added to Token::contents;
+     * otherwise characters are collected in a local block which is
+     * appended to contents at once, like in TextToken::feed().
+     *
+     * Attribute values are followed so that @c > and @c / inside
+     * quotes do not end a tag. Processing instructions, comments and
+     * CDATA sections do not change depth, markup inside them is
+     * ignored.
+     */
+    bool SkipToken::feed(std::istream &in)
+    {
+        std::streambuf *sb = in.rdbuf();
+        char block[256];
+        size_t n = 0;
+        int c;
+
+        while ((c = sb->sbumpc()) != EOF)
+        {
+            advance(c);
+            if (keep)
+            {
+                if (n == sizeof(block))
+                {
+                    contents.append(block, n);
+                    n = 0;
+                }
+                block[n++] = c;
+            }
+            switch (current_state)
+            {
+            case TEXT:
+                if (c == '<')
+                    current_state = LT;
+                break;
+            case LT:
+                if (c == '/')
+                    current_state = ETAG;
+                else if (c == '?')
+                    current_state = PI;
+                else if (c == '!')
+                    current_state = DECL;
+                else
+                    current_state = STAG;
+                break;
+            case STAG:
+                if (c == '"')
+                    current_state = QUOTE;
+                else if (c == '/')
+                    current_state = EMPTY;
+                else if (c == '>')
+                {
+                    depth++;
+                    current_state = TEXT;
+                }
+                break;
+            case QUOTE:
+                if (c == '"')
+                    current_state = STAG;
+                break;
+            case EMPTY:
+                current_state = (c == '>') ? TEXT : STAG;
+                break;
+            case ETAG:
+                if (c == '>')
+                {
+                    current_state = TEXT;
+                    if (--depth == 0)
+                    {
+                        contents.append(block, n);
+                        finished = true;
+                        return true;
+                    }
+                }
+                break;
+            case PI:
+                if (c == '?')
+                    current_state = PI_CLOSE;
+                break;
+            case PI_CLOSE:
+                if (c == '>')
+                    current_state = TEXT;
+                else if (c != '?')
+                    current_state = PI;
+                break;
+            case DECL:
+                if (c == '-')
+                    current_state = COMMENT_OPEN;
+                else if (c == '[')
+                    current_state = CDATA_OPEN;
+                else if (c == '>')
+                    current_state = TEXT;
+                else
+                    current_state = DECL_BODY;
+                break;
+            case DECL_BODY:
+                if (c == '>')
+                    current_state = TEXT;
+                break;
+            case COMMENT_OPEN:
+                current_state = COMMENT;
+                closing = 0;
+                break;
+            case CDATA_OPEN:
+                if (c == '[')
+                {
+                    current_state = CDATA_BODY;
+                    closing = 0;
+                }
+                break;
+            case COMMENT:
+            case CDATA_BODY:
+                if (c == ((current_state == COMMENT) ? '-' : ']'))
+                {
+                    if (closing < 2)
+                        closing++;
+                }
+                else if (c == '>' && closing == 2)
+                    current_state = TEXT;
+                else
+                    closing = 0;
+                break;
+            }
+        }
+        contents.append(block, n);
+        return true;
+    }
+
+    void TextToken::flush(void)
+    {
+        Token::flush();
+        entity.flush();
+    }
+
+    TextToken::TextToken(void)
+    {
+        type = TEXT;
+        flush();
+    }
+
+    TextToken::TextToken(TextToken &t)
+    {
+        type = TEXT;
+        flush();
+        contents = t.contents;
+        entity = t.entity;
+    }
+
+    TextToken* TextToken::copy(void)
+    {
+        return new TextToken(*this);
+    }
+
+    void TextToken::save(CheckpointWriter &w)
+    {
+        Token::save(w);
+        entity.save(w);
+    }
+
+    bool TextToken::restore(CheckpointReader &r)
+    {
+        Token::restore(r);
+        entity.restore(r);
+        return !r.is_failed();
+    }
+
+    bool TextToken::can_eat(std::istream &in)
+    {
+        return is_xmltext(in.peek());
+    }
+
+    /**
+     * Stream interface does not expose its buffer, so text run is
+     * scanned character by character straight from stream buffer
+     * (bypassing istream sentries) and collected in a local block
+     * which is appended to Token::contents at once. Only @c & breaks
+     * the block and passes control to EntityDecoder.
+     */
+    bool TextToken::feed(std::istream &in)
+    {
+        std::streambuf *sb = in.rdbuf();
+        char block[256];
+        size_t n = 0;
+        int c;
+
+        while ((c = sb->sgetc()) != EOF)
+        {
+            if (entity.is_active())
+            {
+                if (!entity.feed(c, contents))
+                    return fail(ENTITY_ERROR);
+            }
+            else if (c == '&')
+            {
+                contents.append(block, n);
+                n = 0;
+                entity.start();
+            }
+            else if (is_xmltext(c))
+            {
+                block[n++] = c;
+                if (n == sizeof(block))
+                {
+                    contents.append(block, n);
+                    n = 0;
+                }
+            }
+            else
+                break;
+            sb->sbumpc();
+            advance(c);
+        }
+        contents.append(block, n);
+
+        /// Markup after unfinished reference
+        if (c != EOF && entity.is_active())
+            return fail(ENTITY_ERROR);
+
+        finished = !entity.is_active();
+        return true;
+    }
+
+    void SpaceToken::flush(void)
+    {
+        Token::flush();
+    }
+
+    SpaceToken::SpaceToken(void)
+        :discard(false)
+    {
+        type = SPACE;
+        flush();
+    }
+
+    SpaceToken::SpaceToken(SpaceToken &t)
+        :discard(t.discard)
+    {
+        type = SPACE;
+        flush();
+        contents = t.contents;
+    }
+
+    SpaceToken* SpaceToken::copy(void)
+    {
+        return new SpaceToken(*this);
+    }
+
+    bool SpaceToken::can_eat(std::istream &in)
+    {
+        return isspace(in.peek());
+    }
+
+    void SpaceToken::set_discard(bool on)
+    {
+        discard = on;
+    }
+
+    bool SpaceToken::feed(std::istream &in)
+    {
+        std::streambuf *sb = in.rdbuf();
+        int c;
+
+        while ((c = sb->sgetc()) != EOF && isspace(c))
+        {
+            if (!discard)
+                contents += (char)(c);
+            sb->sbumpc();
+            advance(c);
+        }
+        finished = true;
+        return true;
+    }
+
+    XmlLexer::XmlLexer(TokenList *l)
+        :current(0), open_pending(false),
+         offset(0), line(1), line_start(0),
+         token_offset(0), token_line(1), token_line_start(0)
+    {
+        tokens = new TokenList();
+        known = new TokenList(*l);
+        skipper = new SkipToken();
+    }
+
+    XmlLexer::~XmlLexer(void)
+    {
+        qwe::TokenList::StlIterator i, end;
+        i = tokens->begin();
+        end = tokens->end();
+
+        // Free copies of read tokens, worker tokens belong to the
+        // owner of the list lexer was constructed with
+        while (i != end)
+        {
+            delete *i;
+            i++;
+        }
+
+        delete tokens;
+        delete known;
+        delete skipper;
+    }
+
+    /**
+     * Call Token::can_eat() for each known lexer token and pick the
+     * first one which returns true. Tokens are tried in the same
+     * order as in the list which was used to construct lexer.
+     */
+    Token* XmlLexer::pick_token(std::istream &in)
+    {
+        TokenList::StlIterator i, end;
+        i = known->begin();
+        end = known->end();
+        while (i != end)
+        {
+            if ((*i)->can_eat(in))
+                return *i;
+            else
+                i++;
+        }
+        return 0;
+    }
+
+    /**
+     * Markup tokens are told apart by the character after `<`. When
+     * `<` is the last character available, it is taken from stream
+     * and the choice waits for the next feed, since the stream it
+     * came from may be gone by then. Token chosen afterwards reads
+     * the kept `<` before the rest of input.
+     */
+    Token* XmlLexer::choose_token(std::istream &in)
+    {
+        char open[2] = {'<', 0};
+        if (!open_pending)
+        {
+            if (in.peek() != '<')
+                return pick_token(in);
+            in.get();
+            if (in.peek() != EOF)
+            {
+                in.putback('<');
+                return pick_token(in);
+            }
+            open_pending = true;
+            return 0;
+        }
+
+        open[1] = in.peek();
+        MemoryBuffer both(open, 2);
+        std::istream look(&both);
+        Token *t = pick_token(look);
+        if (t)
+        {
+            MemoryBuffer first(open, 1);
+            std::istream kept(&first);
+            t->feed(kept);
+        }
+        open_pending = false;
+        return t;
+    }
+
+    void XmlLexer::commit(Token *t)
+    {
+        token_offset = offset;
+        token_line = line;
+        token_line_start = line_start;
+
+        if (t->get_newlines())
+        {
+            line += t->get_newlines();
+            line_start = offset + t->get_line_start();
+        }
+        offset += t->get_consumed();
+    }
+
+    void XmlLexer::fail(error_type type, Token *t)
+    {
+        unsigned long start = line_start;
+
+        error.type = type;
+        error.offset = offset;
+        error.line = line;
+        if (t)
+        {
+            error.offset += t->get_consumed();
+            if (t->get_newlines())
+            {
+                error.line += t->get_newlines();
+                start = offset + t->get_line_start();
+            }
+        }
+        error.column = error.offset - start + 1;
+    }
+
+    void XmlLexer::fail_token(error_type type)
+    {
+        error.type = type;
+        error.offset = token_offset;
+        error.line = token_line;
+        error.column = token_offset - token_line_start + 1;
+    }
+
+    ParseError& XmlLexer::get_error(void)
+    {
+        return error;
+    }
+
+    /**
+     * Worker tokens keep their buffers, so the next document is read
+     * without growing them again.
+     */
+    void XmlLexer::reset(void)
+    {
+        flush();
+        TokenList::StlIterator i = known->begin(), end = known->end();
+        while (i != end)
+        {
+            (*i)->flush();
+            i++;
+        }
+        skipper->flush();
+        current = 0;
+        open_pending = false;
+
+        offset = token_offset = 0;
+        line = token_line = 1;
+        line_start = token_line_start = 0;
+        error.clear();
+    }
+
+    void XmlLexer::release_buffers(void)
+    {
+        TokenList::StlIterator i = known->begin(), end = known->end();
+        while (i != end)
+        {
+            (*i)->get_contents().clear();
+            i++;
+        }
+    }
+
+    /**
+     * Worker token is saved with its index in the list of known
+     * tokens, 0 meaning none and the index past the list meaning
+     * skipper. Finished worker token is flushed before the next one
+     * is read, so it is not saved. Flag of pending `<` comes last.
+     */
+    void XmlLexer::save(CheckpointWriter &w)
+    {
+        w.put_number(offset);
+        w.put_number(line);
+        w.put_number(line_start);
+        w.put_number(token_offset);
+        w.put_number(token_line);
+        w.put_number(token_line_start);
+
+        int index = 0;
+        if (current && !current->is_finished())
+        {
+            if (current == skipper)
+                index = known->get_length() + 1;
+            else
+            {
+                TokenList::StlIterator i = known->begin();
+                for (index = 1; *i != current; index++)
+                    i++;
+            }
+        }
+        w.put_number(index);
+        if (index)
+            current->save(w);
+        w.put_number(open_pending);
+    }
+
+    bool XmlLexer::restore(CheckpointReader &r)
+    {
+        reset();
+        offset = r.get_number();
+        line = r.get_number();
+        line_start = r.get_number(offset);
+        token_offset = r.get_number(offset);
+        token_line = r.get_number(line);
+        token_line_start = r.get_number(token_offset);
+
+        int index = r.get_number(known->get_length() + 1);
+        if (index == known->get_length() + 1)
+            current = skipper;
+        else if (index)
+        {
+            TokenList::StlIterator i = known->begin();
+            while (--index)
+                i++;
+            current = *i;
+        }
+        if (current && !current->restore(r))
+            return false;
+        open_pending = r.get_number(current ? 0 : 1) != 0;
+        return !r.is_failed();
+    }
+
+    unsigned long XmlLexer::get_offset(void)
+    {
+        return offset + open_pending + \
+            (current && !current->is_finished() ? \
+             current->get_consumed() : 0);
+    }
+
+    /**
+     * Read tokens from input stream and add their copies to
+     * XmlLexer::tokens list.
+     */
+    bool XmlLexer::feed(std::istream &in)
+    {
+        Token *t;
+        QWE_STAT(stats.feeds++);
+        QWE_STAT(stats.last_lex_ns = 0);
+        while ((t = next_token(in)))
+            tokens->push_item(t->copy());
+        return error.type == PARSE_OK;
+    }
+
+    /**
+     * Worker token returned by previous call is flushed only when
+     * the next one is requested, so that caller may use its contents
+     * without copying.
+     */
+    Token* XmlLexer::next_token(std::istream &in)
+    {
+        Token *t = 0;
+        if (error.type != PARSE_OK)
+            return 0;
+        QWE_STAT(unsigned long long started = now_ns());
+
+        if (current && current->is_finished())
+        {
+            current->flush();
+            current = 0;
+        }
+
+        while (!t && in.peek() != -1)
+        {
+            /// If there's no token currently being read, choose the
+            /// next one to consume
+            if (!current && !(current = choose_token(in)))
+            {
+                if (!open_pending)
+                    fail(UNKNOWN_TOKEN, 0);
+                break;
+            }
+            if (!current->feed(in))
+            {
+                fail(current->get_error(), current);
+                break;
+            }
+
+            if (current->is_finished())
+            {
+                commit(current);
+                t = current;
+            }
+        }
+
+#ifdef QWE_STATS
+        unsigned long long spent = now_ns() - started;
+        stats.last_lex_ns += spent;
+        stats.lex_ns += spent;
+        if (t)
+        {
+            stats.tokens[t->get_type()]++;
+            stats.bytes[t->get_type()] += t->get_consumed();
+        }
+#endif
+        return t;
+    }
+
+    void XmlLexer::skip_subtree(bool keep)
+    {
+        if (current)
+            current->flush();
+        skipper->set_keep(keep);
+        current = skipper;
+    }
+
+    /**
+     * Wrap XmlLexer::feed() for use with input operator.
+     */
+    std::istream& operator >>(std::istream &in, XmlLexer &l)
+    {
+        if (!l.feed(in))
+            in.setstate(std::ios::failbit);
+        return in;
+    }
+
+    void XmlLexer::flush(void)
+    {
+        TokenList::StlIterator i = tokens->begin(), end = tokens->end();
+        while (i != end)
+        {
+            delete *i;
+            i++;
+        }
+        tokens->clear();
+    }
+
+    TokenList::StlIterator XmlLexer::begin(void)
+    {
+        return tokens->begin();
+    }
+
+    TokenList::StlIterator XmlLexer::end(void)
+    {
+        return tokens->end();
+    }
+
+#ifdef QWE_STATS
+    ParserStats& XmlLexer::get_stats(void)
+    {
+        return stats;
+    }
+
+    ParserStats& XmlParser::get_stats(void)
+    {
+        return lexer->stats;
+    }
+
+    void XmlParser::count_element(ElementNode *e)
+    {
+        ParserStats &s = lexer->stats;
+        ParserStats::record(s.name_lengths, e->get_name().get_length());
+        /// Lazy attributes are not split just for statistics
+        AttrList::StlIterator i, end;
+        if (!lazy_attributes)
+        {
+            i = e->attributes_begin();
+            end = e->attributes_end();
+        }
+        while (i != end)
+        {
+            ParserStats::record(s.attr_lengths, (*i)->get_value().get_length());
+            i++;
+        }
+        if (stack->get_length() + 1 > s.max_depth)
+            s.max_depth = stack->get_length() + 1;
+    }
+#endif
+
+    ElementPath::ElementPath(const char *path)
+    {
+        String *step = 0;
+        while (*path != 0)
+        {
+            if (*path == '/')
+                step = 0;
+            else
+            {
+                if (!step)
+                {
+                    step = new String();
+                    steps.push_item(step);
+                }
+                step->append(*path);
+            }
+            path++;
+        }
+    }
+
+    ElementPath::~ElementPath(void)
+    {
+        List <String *>::StlIterator i = steps.begin(), end = steps.end();
+        while (i != end)
+        {
+            delete *i;
+            i++;
+        }
+    }
+
+    /**
+     * Compare path steps with names of element and its ancestors,
+     * starting from step number @a depth and moving up to the first
+     * one.
+     */
+    bool ElementPath::match_at(XmlNode *n, int depth)
+    {
+        List <String *>::StlIterator i = steps.rbegin(), end = steps.rend();
+        for (int skip = steps.get_length() - depth; skip > 0; skip--)
+            i--;
+
+        while (i != end)
+        {
+            if (!(*(*i) == ((ElementNode *)(n))->get_name()))
+                return false;
+            n = n->get_parent();
+            i--;
+        }
+        return true;
+    }
+
+    ElementPath::relation ElementPath::relate(ElementNode *e, int depth)
+    {
+        int length = steps.get_length();
+        if (length == 0)
+            return UNRELATED;
+
+        if (depth < length)
+            return match_at(e, depth) ? ANCESTOR : UNRELATED;
+
+        XmlNode *n = e;
+        for (int up = depth - length; up > 0; up--)
+            n = n->get_parent();
+        if (!match_at(n, length))
+            return UNRELATED;
+        return (depth == length) ? MATCH : INSIDE;
+    }
+
+    SubtreeHandler::~SubtreeHandler(void)
+    {}
+
+    XmlParser::XmlParser(void)
+    {
+        /// Worker tokens and lists belong to the document too
+        MemoryScope scope(&memory);
+
+        /// Setup lexer
+        {
+            qwe::TokenList xml_tokens;
+            xml_tokens.push_item(new qwe::PiToken());
+            xml_tokens.push_item(new qwe::DeclToken());
+            xml_tokens.push_item(tag_token = new qwe::TagToken());
+            xml_tokens.push_item(space_token = new qwe::SpaceToken());
+            xml_tokens.push_item(new qwe::TextToken());
+            lexer = new XmlLexer(&xml_tokens);
+        }
+
+        stack = new Vector <ElementNode *>;
+        current_node = root = new ElementNode();
+        handlers = new List <PathHandler *>;
+        includes = new List <ElementPath *>;
+        excludes = new List <ElementPath *>;
+        open_text = 0;
+        coalesce_text = true;
+        space_mode = DISCARD_SPACE;
+        pending_space = false;
+        lazy_attributes = false;
+        lazy_depth = 0;
+        recording = false;
+        cache = 0;
+        records = new Vector <ElementNode *>;
+        ranges = 0;
+        open_ranges = new Vector <int>;
+        baseline = memory.get_used();
+    }
+
+    XmlParser::~XmlParser(void)
+    {
+        /// Parser gives back what it has charged to its own account,
+        /// not to that of caller
+        MemoryScope scope(&memory);
+        qwe::TokenList::StlIterator i, end;
+        i = lexer->known->begin();
+        end = lexer->known->end();
+
+        // Free worker tokens
+        while (i != end)
+        {
+            delete *i;
+            i++;
+        }
+
+        List <PathHandler *>::StlIterator h = handlers->begin(),
+            hend = handlers->end();
+        while (h != hend)
+        {
+            if ((*h)->owned)
+                delete (*h)->query;
+            delete *h;
+            h++;
+        }
+
+        List <ElementPath *> *paths[2] = {includes, excludes};
+        for (int k = 0; k < 2; k++)
+        {
+            List <ElementPath *>::StlIterator p = paths[k]->begin(),
+                pend = paths[k]->end();
+            while (p != pend)
+            {
+                delete *p;
+                p++;
+            }
+            delete paths[k];
+        }
+
+        delete lexer;
         delete stack;
         delete root;
+        delete cache;
+        delete records;
+        delete open_ranges;
+        delete handlers;
+    }
+
+    void XmlParser::set_text_coalescing(bool on)
+    {
+        coalesce_text = on;
+    }
+
+    void XmlParser::set_whitespace_mode(whitespace_mode m)
+    {
+        space_mode = m;
+    }
+
+    void XmlParser::set_lazy_attributes(bool on)
+    {
+        lazy_attributes = on;
+        tag_token->set_lazy(on);
+    }
+
+    /**
+     * Characters are never written through get area, so constness
+     * may be cast away.
+     */
+    MemoryBuffer::MemoryBuffer(const char *s, size_t n)
+    {
+        char *p = (char *)(s);
+        setg(p, p, p + n);
+    }
+
+    BoundedBuffer::BoundedBuffer(std::streambuf *s, unsigned long n)
+        :source(s), remaining(n)
+    {
+        setg(block, block, block);
+    }
+
+    /**
+     * Unconsumed characters are put back last first.
+     */
+    BoundedBuffer::~BoundedBuffer(void)
+    {
+        for (char *p = egptr(); p > gptr(); p--)
+            source->sputbackc(p[-1]);
+    }
+
+    bool BoundedBuffer::is_exhausted(void)
+    {
+        return remaining == 0 && gptr() == egptr();
+    }
+
+    /**
+     * Like DeclToken::scan(), only what source already holds is
+     * requested, so that reading never waits for more input than
+     * needed.
+     */
+    int BoundedBuffer::underflow(void)
+    {
+        if (gptr() < egptr())
+            return (unsigned char)(*gptr());
+        if (!remaining)
+            return EOF;
+
+        size_t kept = gptr() - eback();
+        if (kept > PUTBACK)
+            kept = PUTBACK;
+        memmove(block, gptr() - kept, kept);
+
+        std::streamsize avail = source->in_avail();
+        if (avail <= 0)
+        {
+            if (source->sgetc() == EOF)
+                return EOF;
+            avail = source->in_avail();
+            if (avail <= 0)
+                avail = 1;
+        }
+        unsigned long n = sizeof(block) - kept;
+        if ((unsigned long)(avail) < n)
+            n = avail;
+        if (remaining < n)
+            n = remaining;
+
+        n = source->sgetn(block + kept, n);
+        remaining -= n;
+        setg(block, block + kept, block + kept + n);
+        return n ? (unsigned char)(*gptr()) : EOF;
+    }
+
+    /**
+     * Bits of raw children flags recording parser settings, 0 for
+     * defaults. The low bits hold whitespace mode.
+     */
+    enum {LAZY_SPACE_MASK = 3, LAZY_SEPARATE_TEXT = 4, LAZY_ATTRIBUTES = 8};
+
+    /**
+     * Lazy subtree is read by a separate parser from element tag and
+     * recorded markup, keeping the next level lazy again. Children
+     * of its top element are then moved to @a e and charged to the
+     * account of caller, since that of nested parser ends with it.
+     */
+    static bool build_lazy_subtree(ElementNode *e, String &raw, int flags)
+    {
+        XmlParser p;
+        p.set_lazy_depth(2);
+        p.set_whitespace_mode((whitespace_mode)(flags & LAZY_SPACE_MASK));
+        p.set_text_coalescing(!(flags & LAZY_SEPARATE_TEXT));
+        p.set_lazy_attributes(flags & LAZY_ATTRIBUTES);
+
+        String tag("<");
+        tag += e->get_name();
+        tag += ">";
+        MemoryBuffer tag_buffer(tag.get_data(), tag.get_length()),
+            raw_buffer(raw.get_data(), raw.get_length());
+        std::istream tag_stream(&tag_buffer), raw_stream(&raw_buffer);
+        if (p.feed(tag_stream))
+            p.feed(raw_stream);
+
+        ElementNode *top = (ElementNode *)(p.top());
+        if (!top || !p.is_finished() || p.get_error().type != PARSE_OK)
+            return false;
+        Vector <XmlNode *> built;
+        while (top->has_children())
+            built.push_item(top->pop_child());
+        for (int i = built.get_length() - 1; i >= 0; i--)
+        {
+            charge_memory(built[i]->get_memory_size());
+            if (built[i]->get_type() == ELEMENT_NODE)
+                e->add_child((ElementNode *)(built[i]));
+            else
+                e->add_child((TextNode *)(built[i]));
+        }
+        return true;
+    }
+
+    /**
+     * Installs build_lazy_subtree() once when the library is loaded,
+     * so that parsers set up in different threads do not write the
+     * shared builder.
+     */
+    static struct LazyBuilderSetup {
+        LazyBuilderSetup(void)
+        {
+            ElementNode::set_subtree_builder(build_lazy_subtree);
+        }
+    } lazy_builder_setup;
+
+    void XmlParser::set_lazy_depth(int n)
+    {
+        lazy_depth = n;
+    }
+
+    void XmlParser::set_subtree_sharing(bool on)
+    {
+        MemoryScope scope(&memory);
+        if (on && !cache)
+            cache = new SubtreeCache();
+        else if (!on)
+        {
+            delete cache;
+            cache = 0;
+        }
+    }
+
+    int XmlParser::get_shared_count(void)
+    {
+        return cache ? cache->get_count() : 0;
+    }
+
+    void XmlParser::set_memory_budget(size_t bytes)
+    {
+        memory.set_budget(bytes);
+    }
+
+    size_t XmlParser::get_memory_used(void)
+    {
+        return memory.get_used();
+    }
+
+    size_t XmlParser::get_memory_peak(void)
+    {
+        return memory.get_peak();
+    }
+
+    bool XmlParser::is_over_budget(void)
+    {
+        return memory.is_exceeded();
+    }
+
+    /**
+     * Whitespace is not written right away but remembered in
+     * XmlParser::pending_space, and written as one space only when
+     * more text follows in the same run. Leading and trailing
+     * whitespace is thus dropped.
+     */
+    void XmlParser::add_normalized_text(String &s)
+    {
+        String out;
+        const char *c = s.get_data(), *end = c + s.get_length();
+
+        for (; c < end; c++)
+        {
+            if (isspace(*c))
+                pending_space = true;
+            else
+            {
+                if (pending_space && (open_text || !out.is_empty()))
+                    out += ' ';
+                pending_space = false;
+                out += *c;
+            }
+        }
+        if (!out.is_empty())
+            add_text(out);
+    }
+
+    void XmlParser::add_text(String &s)
+    {
+        if (open_text && coalesce_text)
+            open_text->append_contents(s);
+        else
+        {
+            open_text = new TextNode(std::move(s));
+            QWE_STAT(count_alloc(sizeof(TextNode)));
+            current_node->add_child(open_text);
+        }
+    }
+
+    void XmlParser::include_path(const char *path)
+    {
+        includes->push_item(new ElementPath(path));
+    }
+
+    void XmlParser::exclude_path(const char *path)
+    {
+        excludes->push_item(new ElementPath(path));
+    }
+
+    /**
+     * Element is dropped if it is excluded or if include paths are
+     * set and element is neither on the way to nor inside any of
+     * included subtrees.
+     */
+    bool XmlParser::is_projected_out(ElementNode *e, int depth)
+    {
+        List <ElementPath *>::StlIterator i = excludes->begin(),
+            end = excludes->end();
+        while (i != end)
+        {
+            if ((*i)->relate(e, depth) >= ElementPath::MATCH)
+                return true;
+            i++;
+        }
+
+        if (includes->is_empty())
+            return false;
+        i = includes->begin();
+        end = includes->end();
+        while (i != end)
+        {
+            if ((*i)->relate(e, depth) != ElementPath::UNRELATED)
+                return false;
+            i++;
+        }
+        return true;
+    }
+
+    bool XmlParser::is_text_projected_out(void)
+    {
+        if (includes->is_empty() || current_node == root)
+            return false;
+
+        int depth = stack->get_length();
+        List <ElementPath *>::StlIterator i = includes->begin(),
+            end = includes->end();
+        while (i != end)
+        {
+            if ((*i)->relate(current_node, depth) >= ElementPath::MATCH)
+                return false;
+            i++;
+        }
+        return true;
+    }
+
+    void XmlParser::add_handler(Query *q, SubtreeHandler *h)
+    {
+        PathHandler *ph = new PathHandler;
+        ph->query = q;
+        ph->handler = h;
+        ph->owned = false;
+        handlers->push_item(ph);
     }
 
+    bool XmlParser::add_handler(const char *query, SubtreeHandler *h)
+    {
+        Query *q = Query::compile(query);
+        if (!q)
+            return false;
+        add_handler(q, h);
+        handlers->last_item()->owned = true;
+        return true;
+    }
+
+    /**
+     * Queries examine only ancestors and preceding siblings, so an
+     * element is matched when it is opened as well as when it is
+     * completed.
+     */
+    bool XmlParser::is_record(ElementNode *e)
+    {
+        List <PathHandler *>::StlIterator i = handlers->begin(),
+            end = handlers->end();
+        while (i != end)
+        {
+            if ((*i)->query->matches(e))
+                return true;
+            i++;
+        }
+        return false;
+    }
+
+    /**
+     * Completed element is always the last child of its parent, so
+     * it is evicted using ElementNode::pop_child().
+     */
+    bool XmlParser::dispatch(ElementNode *e)
+    {
+        List <PathHandler *>::StlIterator i = handlers->begin(),
+            end = handlers->end();
+        while (i != end)
+        {
+            if ((*i)->query->matches(e))
+            {
+                /// Subtree kept by handler leaves parser account, since
+                /// it is freed outside of it
+                size_t size = e->get_memory_size();
+                bool free_subtree;
+                {
+                    /// Handler allocations are not part of document
+                    MemoryScope scope(0);
+                    free_subtree = (*i)->handler->handle(e);
+                }
+                ((ElementNode *)(e->get_parent()))->pop_child();
+                if (free_subtree)
+                    delete e;
+                else
+                    memory.release(size);
+                return true;
+            }
+            i++;
+        }
+        return false;
+    }
+
+    /**
+     * Tokens are taken from lexer one by one, so that projection may
+     * switch lexer to skipping mode right after an opening tag.
+     */
     bool XmlParser::feed(std::istream &in)
     {
-        TokenList::StlIterator begin, end;
+        if (lexer->error.type != PARSE_OK)
+            return false;
+        return read_tokens(in, 0) != FEED_ERROR;
+    }
+
+    /**
+     * Byte budget is enforced by reading through BoundedBuffer, which
+     * ends input for tokens like the end of stream does.
+     */
+    feed_status XmlParser::feed(std::istream &in, unsigned long max_bytes,
+                                unsigned long max_tokens)
+    {
+        if (lexer->error.type != PARSE_OK)
+            return FEED_ERROR;
+        if (!max_bytes)
+            return read_tokens(in, max_tokens);
 
+        feed_status status;
+        bool exhausted;
+        {
+            BoundedBuffer buffer(in.rdbuf(), max_bytes);
+            std::istream bounded(&buffer);
+            status = read_tokens(bounded, max_tokens);
+            exhausted = buffer.is_exhausted();
+        }
+        if (status != FEED_OK)
+            return status;
+        if (exhausted && in.rdbuf()->sgetc() != EOF)
+            return MORE_PENDING;
+        in.setstate(std::ios::eofbit);
+        return FEED_OK;
+    }
+
+    feed_status XmlParser::read_tokens(std::istream &in, unsigned long max_tokens)
+    {
         // Temporary tokens
         Token *current;
         TagToken *current_tag;
-        TextToken *current_text;
+        ElementNode *element;
+        unsigned long count = 0;
 
-        /// Forget tokens read during last feeding and consume new
-        /// portion
-        lexer->flush();
-        in >> *(lexer);
+        MemoryScope scope(&memory);
 
-        begin = lexer->begin();
-        end = lexer->end();
+#ifdef QWE_STATS
+        ParserStats &stats = lexer->stats;
+        AllocCounters allocs = alloc_counters();
+        stats.feeds++;
+        stats.last_lex_ns = stats.last_build_ns = 0;
+#endif
 
-        while (begin != end)
+        while (true)
         {
-            /// Prohibit multiple top-level elements
-            if (top() && is_finished())
-                error(MULTI_TOP);
+            /// Whitespace contents are only needed when it may
+            /// become text
+            space_token->set_discard(space_mode == NORMALIZE_SPACE || \
+                                     (space_mode == DISCARD_SPACE && \
+                                      !(open_text && coalesce_text)));
+            if (!(current = lexer->next_token(in)))
+            {
+                /// Unfinished token grows with every feed, so budget
+                /// is checked before it completes
+                if (memory.is_exceeded() && lexer->error.type == PARSE_OK)
+                    lexer->fail(MEMORY_LIMIT, lexer->current);
+                break;
+            }
+            QWE_STAT(unsigned long long built = now_ns());
+
+            /// Prohibit multiple top-level elements and text after
+            /// the top-level one; comments, PIs and whitespace may
+            /// follow it
+            if (top() && is_finished() && \
+                (current->get_type() == TAG || \
+                 current->get_type() == TEXT || \
+                 current->get_type() == CDATA))
+            {
+                fail(MULTI_TOP);
+                break;
+            }
 
-            current = *(begin);
             switch (current->get_type())
             {
             case TAG:
+                /// Any element tag ends text run
+                open_text = 0;
+                pending_space = false;
                 current_tag = (TagToken *)(current);
+                element = current_tag->get_element();
                 /// Closing tag must occur only if opening tag with
                 /// the same name is on the top of XmlParser::stack.
                 if (current_tag->is_closing())
                 {
                     if (stack->is_empty())
-                        error(UNEXPECTED_CLOSE);
-                    else if ((current_tag->get_element()->get_name()) == \
-                             stack->last_item()->get_element()->get_name())
-                    {
-                        stack->pop_item();
-                        current_node = (ElementNode *)(current_node->get_parent());
-                    }
+                        fail(UNEXPECTED_CLOSE);
+                    else if (element->get_name() == stack->last_item()->get_name())
+                        close_element();
                     else
-                        error(UNBALANCED_TAG);
+                        fail(UNBALANCED_TAG);
                 }
                 else
                 {
-                    current_node->add_child(current_tag->get_element());
+                    /// Tree takes over the element of opening tag
+                    current_node->add_child(current_tag->take_element());
 
+                    if (is_projected_out(element, stack->get_length() + 1))
+                    {
+                        delete current_node->pop_child();
+                        if (!current_tag->is_empty())
+                            lexer->skip_subtree();
+                    }
                     /// Empty tags are not pushed to stack because
                     /// they don't need to be closed
-                    if (!current_tag->is_empty())
+                    else if (!current_tag->is_empty())
+                    {
+                        QWE_STAT(count_element(element));
+                        if (ranges)
+                        {
+                            open_ranges->push_item(ranges->get_length());
+                            add_range(element, lexer->offset);
+                        }
+                        stack->push_item(element);
+                        current_node = element;
+                        if (cache && is_record(element))
+                            records->push_item(element);
+                        /// Contents below eager levels are recorded
+                        if (stack->get_length() == lazy_depth)
+                        {
+                            recording = true;
+                            lexer->skip_subtree(true);
+                        }
+                    }
+                    else
                     {
-                        stack->push_item(current_tag);
-                        current_node = (ElementNode *)(current_node->last_child());
+                        QWE_STAT(count_element(element));
+                        if (ranges)
+                            add_range(element, lexer->offset);
+                        complete_element(element);
                     }
                 }
                 break;
 
             case TEXT:
-                current_text = (TextToken *)(current);
-                current_node->add_child(new TextNode(current_text->get_contents()));
+            case CDATA:
+                QWE_STAT(ParserStats::record(stats.text_lengths,
+                                             current->get_contents().get_length()));
+                if (is_text_projected_out())
+                    break;
+                if (space_mode == NORMALIZE_SPACE)
+                    add_normalized_text(current->get_contents());
+                else
+                    add_text(current->get_contents());
+                break;
+
+            case SPACE:
+                /// Whitespace of prolog and epilog is markup, not
+                /// content, in every mode
+                if (stack->is_empty())
+                    break;
+                if (space_mode == PRESERVE_SPACE)
+                {
+                    if (!is_text_projected_out())
+                        add_text(current->get_contents());
+                }
+                /// Whitespace continuing text split between feeds
+                else if (open_text && coalesce_text)
+                {
+                    if (space_mode == NORMALIZE_SPACE)
+                        pending_space = true;
+                    else
+                        add_text(current->get_contents());
+                }
+                break;
+
+            case SKIP:
+                open_text = 0;
+                pending_space = false;
+                if (recording)
+                {
+                    recording = false;
+                    int flags = space_mode | \
+                        (coalesce_text ? 0 : LAZY_SEPARATE_TEXT) | \
+                        (lazy_attributes ? LAZY_ATTRIBUTES : 0);
+                    current_node->set_raw_children(std::move(current->get_contents()),
+                                                   flags);
+                    close_element();
+                }
+                break;
+
+            default:
                 break;
             }
-            begin++;
+
+#ifdef QWE_STATS
+            unsigned long long spent = now_ns() - built;
+            stats.last_build_ns += spent;
+            stats.build_ns += spent;
+#endif
+
+            if (memory.is_exceeded() && lexer->error.type == PARSE_OK)
+                lexer->fail(MEMORY_LIMIT, 0);
+            if (lexer->error.type != PARSE_OK)
+                break;
+            if (++count == max_tokens)
+                break;
         }
-        return true;
+
+#ifdef QWE_STATS
+        stats.allocations += alloc_counters().allocations - allocs.allocations;
+        stats.allocated_bytes += alloc_counters().bytes - allocs.bytes;
+#endif
+        if (lexer->error.type != PARSE_OK)
+        {
+            fail();
+            return FEED_ERROR;
+        }
+        if (max_tokens && count == max_tokens && in.rdbuf()->sgetc() != EOF)
+            return MORE_PENDING;
+        return FEED_OK;
+    }
+
+    void XmlParser::close_element(void)
+    {
+        ElementNode *closed = current_node;
+        if (ranges)
+        {
+            (*ranges)[open_ranges->last_item()].end = lexer->offset;
+            open_ranges->pop_item();
+        }
+        stack->pop_item();
+        if (!records->is_empty() && records->last_item() == closed)
+            records->pop_item();
+        current_node = (ElementNode *)(current_node->get_parent());
+        complete_element(closed);
+    }
+
+    /**
+     * End of elements which are not complete yet is set when they are
+     * closed.
+     */
+    void XmlParser::add_range(ElementNode *e, unsigned long end)
+    {
+        ElementRange r = {e, lexer->token_offset, end};
+        ranges->push_item(r);
+    }
+
+    /**
+     * Completed element is the last child of current node, so it is
+     * swapped with pop_child() and add_child().
+     */
+    void XmlParser::complete_element(ElementNode *e)
+    {
+        if (!handlers->is_empty() && dispatch(e))
+            return;
+        if (!cache || !records->is_empty())
+            return;
+
+        ElementNode *shared = cache->intern(e);
+        if (shared != e)
+        {
+            current_node->pop_child();
+            e->release();
+            current_node->add_child((ElementNode *)(shared->share()));
+        }
+    }
+
+    bool XmlParser::fail(void)
+    {
+        lexer->error.depth = stack->get_length();
+        return false;
+    }
+
+    void XmlParser::fail(error_type type)
+    {
+        lexer->fail_token(type);
+    }
+
+    const ParseError& XmlParser::get_error(void)
+    {
+        return lexer->get_error();
+    }
+
+    /**
+     * Root element, lists and worker token buffers are reused. Token
+     * buffers are only freed if they keep parser over its memory
+     * budget.
+     */
+    void XmlParser::reset(void)
+    {
+        MemoryScope scope(&memory);
+
+        while (root->has_children())
+            root->pop_child()->release();
+        if (cache)
+            cache->clear();
+        current_node = root;
+        stack->clear();
+        records->clear();
+        lexer->reset();
+        if (memory.is_exceeded())
+            lexer->release_buffers();
+        memory.reset_peak();
+        open_text = 0;
+        pending_space = false;
+        recording = false;
+        open_ranges->clear();
+        baseline = memory.get_used();
     }
 
     /**
-     * Wrap XmlParser::feed() for use with input operator.
+     * Wrap XmlParser::feed() for use with input operator, setting
+     * failbit of stream if parser failed.
      */
     std::istream& operator >>(std::istream &in, XmlParser &p)
     {
-        p.feed(in);
+        if (!p.feed(in))
+            in.setstate(std::ios::failbit);
         return in;
     }
 
@@ -736,4 +2606,208 @@ namespace qwe {
     {
         return root->first_child();
     }
+
+    /**
+     * Parser account only knows total usage, so all usage above the
+     * baseline is attributed to the tree.
+     */
+    ElementNode* XmlParser::take_top(void)
+    {
+        if (!top() || !is_finished() || get_error().type != PARSE_OK)
+            return 0;
+
+        ElementNode *e = (ElementNode *)(root->pop_child());
+        size_t base = baseline;
+        reset();
+        if (memory.get_used() > base)
+            memory.release(memory.get_used() - base);
+        memory.reset_peak();
+        baseline = memory.get_used();
+        return e;
+    }
+
+    Document* XmlParser::freeze(void)
+    {
+        ElementNode *e = take_top();
+        return e ? new Document(e) : 0;
+    }
+
+    void XmlParser::record_ranges(RangeList *r)
+    {
+        ranges = r;
+    }
+
+    /**
+     * Checkpoint blob starts with format signature.
+     */
+    static const char checkpoint_magic[] = "QWC1";
+
+    static void save_node(CheckpointWriter &w, XmlNode *n)
+    {
+        w.put_number(n->get_type());
+        if (n->get_type() == TEXT_NODE)
+        {
+            w.put_string(((TextNode *)(n))->get_contents());
+            return;
+        }
+
+        ElementNode *e = (ElementNode *)(n);
+        w.put_string(e->get_name());
+        int count = e->get_attributes_count();
+        w.put_number(count);
+        for (int i = 0; i < count; i++)
+        {
+            w.put_string(e->get_attribute(i)->get_name());
+            w.put_string(e->get_attribute(i)->get_value());
+        }
+        count = e->get_children_count();
+        w.put_number(count);
+        for (int i = 0; i < count; i++)
+            save_node(w, e->get_child(i));
+    }
+
+    static void add_node(ElementNode *e, XmlNode *n)
+    {
+        if (n->get_type() == ELEMENT_NODE)
+            e->add_child((ElementNode *)(n));
+        else
+            e->add_child((TextNode *)(n));
+    }
+
+    /**
+     * Read element name and attributes, but not children.
+     */
+    static ElementNode* restore_element(CheckpointReader &r)
+    {
+        ElementNode *e = new ElementNode();
+        r.get_string(e->get_name());
+        unsigned long n = r.get_number();
+        for (unsigned long i = 0; i < n && !r.is_failed(); i++)
+        {
+            String key, value;
+            r.get_string(key);
+            r.get_string(value);
+            e->add_attribute(std::move(key), std::move(value));
+        }
+        return e;
+    }
+
+    static XmlNode* restore_node(CheckpointReader &r);
+
+    /**
+     * Read children of @a e.
+     */
+    static void restore_children(CheckpointReader &r, ElementNode *e)
+    {
+        unsigned long n = r.get_number();
+        for (unsigned long i = 0; i < n && !r.is_failed(); i++)
+            add_node(e, restore_node(r));
+    }
+
+    static XmlNode* restore_node(CheckpointReader &r)
+    {
+        if (r.get_number(ELEMENT_NODE) == TEXT_NODE)
+        {
+            String s;
+            r.get_string(s);
+            return new TextNode(std::move(s));
+        }
+        ElementNode *e = restore_element(r);
+        restore_children(r, e);
+        return e;
+    }
+
+    /**
+     * Open elements are saved from the top-level one down, each
+     * followed by its children except the last one, which is the
+     * next open element. Root is saved first with all its children
+     * if no element is open.
+     */
+    bool XmlParser::save(String &out)
+    {
+        if (lexer->error.type != PARSE_OK)
+            return false;
+
+        CheckpointWriter w(out);
+        w.put_chars(checkpoint_magic, sizeof(checkpoint_magic) - 1);
+        lexer->save(w);
+
+        int depth = stack->get_length();
+        w.put_number(depth);
+        for (int level = 0; level <= depth; level++)
+        {
+            ElementNode *e = level ? (*stack)[level - 1] : root;
+            if (level)
+            {
+                w.put_string(e->get_name());
+                int n = e->get_attributes_count();
+                w.put_number(n);
+                for (int i = 0; i < n; i++)
+                {
+                    w.put_string(e->get_attribute(i)->get_name());
+                    w.put_string(e->get_attribute(i)->get_value());
+                }
+            }
+            int n = e->get_children_count() - (level < depth ? 1 : 0);
+            w.put_number(n);
+            for (int i = 0; i < n; i++)
+                save_node(w, e->get_child(i));
+        }
+
+        w.put_number(open_text != 0);
+        w.put_number(pending_space);
+        w.put_number(recording);
+        return true;
+    }
+
+    bool XmlParser::restore(const char *s, size_t n)
+    {
+        reset();
+        MemoryScope scope(&memory);
+        CheckpointReader r(s, n);
+
+        char magic[sizeof(checkpoint_magic)];
+        size_t length = r.get_chars(magic, sizeof(magic));
+        bool ok = (length == sizeof(checkpoint_magic) - 1 && \
+                   !memcmp(magic, checkpoint_magic, length) && \
+                   lexer->restore(r));
+
+        int depth = ok ? r.get_number(INT_MAX) : 0;
+        for (int level = 0; ok && level <= depth && !r.is_failed(); level++)
+        {
+            if (level)
+            {
+                ElementNode *e = restore_element(r);
+                current_node->add_child(e);
+                stack->push_item(e);
+                current_node = e;
+                if (cache && is_record(e))
+                    records->push_item(e);
+            }
+            restore_children(r, current_node);
+        }
+
+        if (r.get_flag())
+        {
+            XmlNode *last = current_node->last_child();
+            if (last && last->get_type() == TEXT_NODE)
+                open_text = (TextNode *)(last);
+            else
+                ok = false;
+        }
+        pending_space = r.get_flag();
+        recording = r.get_flag();
+
+        if (!ok || r.is_failed() || !r.is_finished())
+        {
+            reset();
+            return false;
+        }
+        return true;
+    }
+
+    unsigned long XmlParser::get_offset(void)
+    {
+        return lexer->get_offset();
+    }
 }
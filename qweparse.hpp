@@ -1,20 +1,66 @@
 #ifndef QWE_XMLPARSE_H
 #define QWE_XMLPARSE_H
 #include "qwexml.hpp"
+#include "qweintern.hpp"
+#include "qwedocument.hpp"
+#include "qwequery.hpp"
+#include "qwestats.hpp"
+#include "qwememory.hpp"
 #include <iostream>
 #include <stdlib.h>
 
 namespace qwe {
 
-    enum token_type {NONE, TAG, SPACE, TEXT, PI};
+    enum token_type {NONE, TAG, SPACE, TEXT, PI, SKIP,
+                     COMMENT, CDATA, DOCTYPE,
+                     /// Number of token types
+                     TOKEN_TYPES};
 
-    enum error_type {UNKNOWN_TOKEN, TAG_ERROR, PI_ERROR,
-                     UNBALANCED_TAG, UNEXPECTED_CLOSE, MULTI_TOP};
+    /**
+     * Treatment of whitespace in document.
+     *
+     * @see XmlParser::set_whitespace_mode()
+     */
+    enum whitespace_mode {DISCARD_SPACE, PRESERVE_SPACE, NORMALIZE_SPACE};
+
+    enum error_type {PARSE_OK, UNKNOWN_TOKEN, TAG_ERROR, PI_ERROR,
+                     UNBALANCED_TAG, UNEXPECTED_CLOSE, MULTI_TOP,
+                     ENTITY_ERROR, DECL_ERROR, MEMORY_LIMIT};
+
+    /**
+     * Result of feeding with a budget.
+     *
+     * @see XmlParser::feed(std::istream &, unsigned long, unsigned long)
+     */
+    enum feed_status {FEED_ERROR, FEED_OK, MORE_PENDING};
 
     /**
-     * Simple error handler.
+     * Human-readable description of error type.
      */
-    void error(error_type n);
+    const char* error_message(error_type n);
+
+    /**
+     * Error found in input.
+     *
+     * Offset is counted in bytes from the beginning of document, line
+     * and column start from 1 (column is counted in bytes too). Depth
+     * is the number of elements open when error occured.
+     *
+     * Errors in tokens point to the offending character, errors in
+     * document structure (like unbalanced tags) point to the start of
+     * offending tag.
+     */
+    struct ParseError {
+        error_type type;
+        unsigned long offset;
+        unsigned long line;
+        unsigned long column;
+        int depth;
+
+        ParseError(void);
+
+        void clear(void);
+    };
 
     /**
      * Token class.
@@ -58,7 +104,53 @@ namespace qwe {
          * True if token was completely read.
          */
         bool finished;
+
+        /**
+         * Number of characters taken from input stream since last
+         * flush.
+         */
+        unsigned long consumed;
+
+        /**
+         * Number of newlines among consumed characters and value of
+         * Token::consumed right after the last one.
+         */
+        unsigned long newlines;
+        unsigned long line_start;
+
+        /**
+         * Reason why feed() returned false.
+         */
+        error_type failure;
+
+        /**
+         * Count character taken from input stream.
+         *
+         * @internal Called for every character, so defined here to
+         * be inlined.
+         */
+        void advance(char c)
+        {
+            consumed++;
+            if (c == '\n')
+            {
+                newlines++;
+                line_start = consumed;
+            }
+        }
+
+        /**
+         * Count block of characters taken from input stream.
+         */
+        void advance(const char *s, size_t n);
+
+        /**
+         * Record error and return false for use in feed().
+         */
+        bool fail(error_type e);
     public:
+        virtual ~Token(void);
+
         /**
          * Prepares token to consume next portion of character data.
          */
@@ -89,12 +181,37 @@ namespace qwe {
          *
          * Implementations must also add read contents to
          * Token::contents.
+         *
+         * @return False if input is malformed, see get_error().
+         * Offending character is left in stream.
          */
         virtual bool feed(std::istream &in) = 0;
 
         bool is_finished(void);
 
+        unsigned long get_consumed(void);
+
+        unsigned long get_newlines(void);
+
+        unsigned long get_line_start(void);
+
+        error_type get_error(void);
+
         virtual Token* copy(void) = 0;
+
+        /**
+         * Append state of unfinished token to checkpoint.
+         *
+         * Tokens extend this with state of their FA.
+         */
+        virtual void save(CheckpointWriter &w);
+
+        /**
+         * Restore state written by save() into flushed token.
+         *
+         * @return False if checkpoint is malformed.
+         */
+        virtual bool restore(CheckpointReader &r);
     };
 
     /**
@@ -154,7 +271,8 @@ namespace qwe {
         bool empty;
 
         /**
-         * Empty element node object for this token.
+         * Element node object for this token, created with the first
+         * character of tag name and owned by token until taken.
          */
         ElementNode* element;
 
@@ -173,26 +291,74 @@ namespace qwe {
          */
         String current_value;
 
+        /**
+         * Decoder for references in attribute value.
+         */
+        EntityDecoder value_entity;
+
+        /**
+         * True if attributes are kept as raw region of tag until
+         * accessed.
+         */
+        bool lazy;
+
+        /**
+         * True if at least one attribute has been read.
+         */
+        bool attributes_read;
+
     public:
         void flush(void);
 
         TagToken(void);
 
+        /**
+         * Copy takes over element of @a t.
+         */
         TagToken(TagToken &t);
 
+        ~TagToken(void);
+
         TagToken* copy(void);
 
+        /**
+         * Element read from tag, still owned by token.
+         *
+         * For closing tags only its name is set.
+         */
         ElementNode* get_element(void);
 
+        /**
+         * Pass ownership of read element to caller.
+         */
+        ElementNode* take_element(void);
+
         bool is_closing(void);
 
         bool is_empty(void);
 
+        /**
+         * Turns lazy attribute reading on or off. Must not be called
+         * while a tag is being read.
+         *
+         * Attributes are still checked while tag is read, but instead
+         * of building AttrNode objects the raw attribute region is
+         * stored in element with ElementNode::set_raw_attributes().
+         */
+        void set_lazy(bool on);
+
         /**
          * Reads tag from stream and sets TagToken::element field.
          */
         bool feed(std::istream &in);
 
+        /**
+         * Element read so far is saved with its name and attributes.
+         */
+        void save(CheckpointWriter &w);
+
+        bool restore(CheckpointReader &r);
+
         /**
          * Returns true if stream contains a tag.
          */
@@ -232,203 +398,1146 @@ namespace qwe {
          * Reads processing instruction from stream.
          */
         bool feed(std::istream &in);
-    };
 
-    /**
-     * Functional class for determining space between XML tags.
-     */
-    class Fis_xmlspace {
-    public:
-        bool operator () (char c);
-    };
+        void save(CheckpointWriter &w);
 
-    /**
-     * Functional class for determining text node contents.
-     */
-    class Fis_xmltext {
-    public:
-        bool operator () (char c);
+        bool restore(CheckpointReader &r);
     };
 
     /**
-     * Template for token classes which infinitely read character data for
-     * which F holds.
+     * Token for markup starting with <code>&lt;!</code>: comments,
+     * CDATA sections and document type declarations.
      *
-     * @param F Functional object for testing character data.
+     * Token type is set to COMMENT, CDATA or DOCTYPE as soon as the
+     * keyword after <code>&lt;!</code> is read. Contents of CDATA
+     * section are stored as one block of character data, contents
+     * of DOCTYPE are stored raw, comments are not stored at all.
      */
-    template <class F, token_type T>
-    class SimpleToken : public Token {
+    class DeclToken : public Token {
+    private:
+        /**
+         * Possible states of FA used to read markup declaration.
+         */
+        enum state {START, OPEN, KEYWORD, BODY, END};
+
+        /**
+         * Current state of FA.
+         */
+        state current_state;
+
+        /**
+         * Keyword which must follow <code>&lt;!</code>.
+         */
+        const char *keyword;
+
+        /**
+         * Number of keyword characters read.
+         */
+        int matched;
+
+        /**
+         * Number of terminator characters at the end of last read
+         * block which may start terminator.
+         */
+        size_t held;
+
+        /**
+         * Nesting of internal subset brackets in DOCTYPE.
+         */
+        int brackets;
+
+        /**
+         * Quote character of DOCTYPE literal being read, 0 outside
+         * literals.
+         */
+        char quote;
+
+        /**
+         * Read stream in blocks until terminator is found.
+         *
+         * Terminator is looked up in each block with memmem(), then
+         * characters read past it are returned to stream buffer.
+         *
+         * @param keep If true, read data is appended to
+         * Token::contents.
+         *
+         * @return True if terminator has been found.
+         */
+        bool scan(std::istream &in, const char *terminator, bool keep);
+
+        /**
+         * Read DOCTYPE until closing @c > outside of literals and
+         * internal subset.
+         */
+        bool scan_doctype(std::istream &in);
+
     public:
-        SimpleToken(void)
-        {
-            type = T;
-            flush();
-        }
+        void flush(void);
 
-        SimpleToken(SimpleToken &t)
-        {
-            type = T;
-            flush();
-            contents = t.contents;
-        }
+        DeclToken(void);
 
-        SimpleToken* copy(void)
-        {
-            return new SimpleToken(*this);
-        }
+        DeclToken(DeclToken &t);
 
-        bool can_eat(std::istream &in)
-        {
-            return (F()(in.peek()));
-        }
+        DeclToken* copy(void);
 
         /**
-         * Read characters while filtering function holds.
+         * Returns true if stream starts from <code>&lt;!</code>.
          */
-        bool feed(std::istream &in)
-        {
-            char c;
-            while ((c = in.get()))
-            {
-                if (F()(c))
-                    contents += c;
-                else
-                {
-                    /// @internal When EOF occurs, SimpleToken is
-                    /// ended. Thus text and space nodes are read in
-                    /// portions.
-                    in.putback(c);
-                    finished = true;
-                    return true;
-                }
-            }
-            return false;
-        }
-    };
+        bool can_eat(std::istream &in);
+
+        bool feed(std::istream &in);
 
-    typedef SimpleToken<Fis_xmltext, TEXT> TextToken;
-    typedef SimpleToken<Fis_xmlspace, SPACE> SpaceToken;
+        /**
+         * Keyword is not saved, since it follows from token type.
+         */
+        void save(CheckpointWriter &w);
 
-    typedef List <Token *> TokenList;
+        bool restore(CheckpointReader &r);
+    };
 
-    class XmlLexer {
+    /**
+     * Token which consumes the rest of an element without building
+     * anything.
+     *
+     * Never chosen by lexer through can_eat(), lexer switches to it
+     * explicitly after an opening tag has been read.
+     *
+     * @see XmlLexer::skip_subtree()
+     */
+    class SkipToken : public Token {
     private:
         /**
-         * List of complete read tokens.
+         * Possible states of FA used to skip markup.
          */
-        TokenList *tokens;
+        enum state {TEXT, LT, STAG, QUOTE, EMPTY, ETAG, PI, PI_CLOSE,
+                    DECL, DECL_BODY, COMMENT_OPEN, COMMENT, CDATA_OPEN,
+                    CDATA_BODY};
 
         /**
-         * List of known token types.
-         *
-         * Used as workers to read characters. Flushed after every
-         * complete token successfully read.
+         * Current state of skipping FA.
          */
-        TokenList *known;
+        state current_state;
 
         /**
-         * Token currently being read.
+         * Number of elements still open in skipped subtree.
          */
-        Token* current;
+        int depth;
 
         /**
-         * Choose known token to read next stream data.
-         *
-         * In case no known token can be read, error() is called.
-         *
-         * @return Pointer to appropriate Token.
+         * Number of dashes or brackets read which may end comment or
+         * CDATA section.
          */
-        Token* choose_token(std::istream &in);
+        int closing;
 
-        friend class XmlParser;
-    public:
         /**
-         * Constructs new lexer object using a list of tokens.
+         * True if skipped characters are stored in Token::contents.
          */
-        XmlLexer(TokenList *l);
+        bool keep;
 
-        ~XmlLexer(void);
+    public:
+        void flush(void);
+
+        SkipToken(void);
+
+        SkipToken(SkipToken &t);
+
+        SkipToken* copy(void);
 
         /**
-         * Choose next token and completely read it.
+         * Always false, see class description.
          */
-        bool feed(std::istream &in);
+        bool can_eat(std::istream &);
 
         /**
-         * Clears list of read tokens.
+         * Turns storing of skipped characters on or off for the next
+         * skipped element.
          */
-        void flush(void);
+        void set_keep(bool on);
 
         /**
-         * Iterator for the list of read tokens.
+         * Reads characters until the element which was open when
+         * skipping started is closed.
          */
-        TokenList::StlIterator begin(void);
-        TokenList::StlIterator end(void);
+        bool feed(std::istream &in);
+
+        void save(CheckpointWriter &w);
+
+        bool restore(CheckpointReader &r);
     };
 
-   /**
-    * XML parser class.
-    *
-    * Utilizes XmlLexer to parse input stream into a list of tokens
-    * which are translated into a tree of ElementNode objects.
-    *
-    * Portions of XML data are fed to parser using input operator.
-    * XmlParser::is_finished() method is used to check if parsing is
-    * complete.
-    */
-    class XmlParser
-    {
+    /**
+     * Text node token.
+     *
+     * Character data is scanned directly from stream buffer and
+     * copied to token contents in blocks. Entity decoding only takes
+     * place when @c & is actually found.
+     */
+    class TextToken : public Token {
     private:
-        XmlLexer *lexer;
+        EntityDecoder entity;
 
-        /**
-         * Root element contains just top-level element of the XML
-         * document.
-         *
-         * @see XmlParser::top()
-         */
-        ElementNode *root;
+    public:
+        void flush(void);
+
+        TextToken(void);
+
+        TextToken(TextToken &t);
+
+        TextToken* copy(void);
+
+        bool can_eat(std::istream &in);
 
         /**
-         * Stack of open tag elements.
+         * Read text until markup starts.
          *
-         * @todo Balancing is checked using tag names, so a list of
-         * strings will be sufficient here.
+         * When EOF occurs, token is ended, so text nodes are read in
+         * portions. Token is only left unfinished if EOF occurs
+         * inside a reference.
          */
-        List <TagToken *> *stack;
+        bool feed(std::istream &in);
 
+        void save(CheckpointWriter &w);
+
+        bool restore(CheckpointReader &r);
+    };
+    /**
+     * Token for whitespace between markup.
+     *
+     * Whitespace is read straight from stream buffer. In discarding
+     * mode it is only skipped, leaving Token::contents empty, so no
+     * memory is allocated.
+     */
+    class SpaceToken : public Token {
+    private:
         /**
-         * XML element currently being read.
+         * True if read whitespace is not stored.
          */
-        ElementNode *current_node;
+        bool discard;
+
     public:
-        XmlParser(void);
+        void flush(void);
 
-        ~XmlParser(void);
+        SpaceToken(void);
+
+        SpaceToken(SpaceToken &t);
+
+        SpaceToken* copy(void);
+
+        bool can_eat(std::istream &in);
 
         /**
-         * Reads a portion of XML data from input stream and updates
-         * XmlParser::root.
-         *
-         * New elements are added into the tree as opening tags occur
-         * in the input stream.
-         *
-         * @see XmlParser::is_finished()
+         * Read whitespace. Token is ended when EOF occurs.
          */
         bool feed(std::istream &in);
 
         /**
-         * Checks if parsing is complete.
-         *
-         * @return True if current top-level element has been
-         * completely read from opening to closing tag
+         * Turns discarding of whitespace on or off, starting from
+         * the next read token.
          */
-        bool is_finished(void);
+        void set_discard(bool on);
+    };
+
+    typedef List <Token *> TokenList;
+
+#ifdef QWE_STATS
+    /**
+     * Parser statistics, available when compiled with QWE_STATS.
+     *
+     * Histograms have logarithmic buckets: bucket 0 counts zero
+     * lengths, bucket @c i counts lengths from 2<sup>i-1</sup> to
+     * 2<sup>i</sup>-1, the last bucket also counts all longer ones.
+     *
+     * @see export_stats()
+     */
+    struct ParserStats {
+        enum {BUCKETS = 16};
 
         /**
-         * First top-level element.
+         * Completely read tokens and their sizes in input bytes, by
+         * token type.
          */
-        XmlNode* top(void);
+        unsigned long tokens[TOKEN_TYPES];
+        unsigned long bytes[TOKEN_TYPES];
+
+        /**
+         * Allocations made while feeding.
+         */
+        unsigned long allocations;
+        unsigned long allocated_bytes;
+
+        int max_depth;
+
+        unsigned long name_lengths[BUCKETS];
+        unsigned long text_lengths[BUCKETS];
+        unsigned long attr_lengths[BUCKETS];
+
+        unsigned long feeds;
+
+        /**
+         * Time spent in lexer and in tree building, in nanoseconds,
+         * during the last feed and in total.
+         */
+        unsigned long long last_lex_ns;
+        unsigned long long last_build_ns;
+        unsigned long long lex_ns;
+        unsigned long long build_ns;
+
+        ParserStats(void);
+
+        void clear(void);
+
+        /**
+         * Count length in histogram.
+         */
+        static void record(unsigned long *histogram, size_t length);
+    };
+
+    /**
+     * Write statistics in Prometheus text format, every metric name
+     * starting with @a prefix.
+     */
+    void export_stats(ParserStats &s, std::ostream &o,
+                      const char *prefix = "qwexml");
+#endif
+
+    class XmlLexer {
+    private:
+        /**
+         * List of complete read tokens.
+         */
+        TokenList *tokens;
+
+        /**
+         * List of known token types.
+         *
+         * Used as workers to read characters. Flushed after every
+         * complete token successfully read.
+         */
+        TokenList *known;
+
+        /**
+         * Token currently being read.
+         */
+        Token* current;
+
+        /**
+         * Worker token used by skip_subtree().
+         */
+        SkipToken* skipper;
+
+        /**
+         * True if `<` has been taken as the last character of input,
+         * so that token it starts is chosen when the next character
+         * comes.
+         */
+        bool open_pending;
+
+#ifdef QWE_STATS
+        ParserStats stats;
+#endif
+
+        /**
+         * Position after the last complete token: byte offset, line
+         * number and offset of the first byte of line.
+         */
+        unsigned long offset;
+        unsigned long line;
+        unsigned long line_start;
+
+        /**
+         * Position where the last complete token started.
+         */
+        unsigned long token_offset;
+        unsigned long token_line;
+        unsigned long token_line_start;
+
+        ParseError error;
+
+        /**
+         * Choose known token to read next stream data.
+         *
+         * @return Pointer to appropriate Token or 0 if no known token
+         * can be read or the choice is deferred (see open_pending).
+         */
+        Token* choose_token(std::istream &in);
+
+        /**
+         * Pick the first known token which can eat @a in.
+         */
+        Token* pick_token(std::istream &in);
+
+        /**
+         * Move position past complete token.
+         */
+        void commit(Token *t);
+
+        /**
+         * Record error at current position, including characters
+         * consumed by unfinished token @a t (if any).
+         */
+        void fail(error_type type, Token *t);
+
+        friend class XmlParser;
+    public:
+        /**
+         * Constructs new lexer object using a list of tokens.
+         */
+        XmlLexer(TokenList *l);
+
+        ~XmlLexer(void);
+
+        /**
+         * Read all tokens available in input stream and add their
+         * copies to the list of read tokens.
+         *
+         * @return False if input is malformed, see get_error().
+         */
+        bool feed(std::istream &in);
+
+        /**
+         * Read next token from input stream.
+         *
+         * @return Worker token which was completely read (valid until
+         * the next call) or 0 if input ended while token is still
+         * incomplete or an error occured. After an error, 0 is
+         * returned until reset().
+         */
+        Token* next_token(std::istream &in);
+
+        /**
+         * Skip the rest of element whose opening tag has just been
+         * returned by next_token().
+         *
+         * Skipped characters are only checked for tag balance. They
+         * are stored in contents of SKIP token if @a keep is true and
+         * dropped otherwise. next_token() returns a token of type
+         * SKIP when the element is closed.
+         */
+        void skip_subtree(bool keep = false);
+
+        /**
+         * Clears list of read tokens.
+         */
+        void flush(void);
+
+        /**
+         * Record error of document structure at the start of the
+         * last complete token.
+         */
+        void fail_token(error_type type);
+
+        ParseError& get_error(void);
+
+        /**
+         * Forget read tokens, position and error to start reading new
+         * document.
+         */
+        void reset(void);
+
+        /**
+         * Free character buffers of worker tokens.
+         */
+        void release_buffers(void);
+
+        /**
+         * Append position and unfinished worker token to checkpoint.
+         */
+        void save(CheckpointWriter &w);
+
+        /**
+         * Reset lexer and restore state written by save().
+         *
+         * @return False if checkpoint is malformed.
+         */
+        bool restore(CheckpointReader &r);
+
+        /**
+         * Bytes of document taken from input stream, including those
+         * of unfinished token.
+         */
+        unsigned long get_offset(void);
+
+        /**
+         * Iterator for the list of read tokens.
+         */
+        TokenList::StlIterator begin(void);
+        TokenList::StlIterator end(void);
+
+#ifdef QWE_STATS
+        /**
+         * Token counts and sizes, lexing time.
+         */
+        ParserStats& get_stats(void);
+#endif
+    };
+
+    /**
+     * Absolute path of element in document tree, like
+     * <code>/catalog/item</code>.
+     */
+    class ElementPath {
+    private:
+        /**
+         * Element names from top-level element down.
+         */
+        List <String *> steps;
+
+        /**
+         * Check if first @a depth steps of path match names of
+         * element @a n and its ancestors.
+         */
+        bool match_at(XmlNode *n, int depth);
+
+    public:
+        /**
+         * Position of element relative to the path.
+         */
+        enum relation {UNRELATED, ANCESTOR, MATCH, INSIDE};
+
+        /**
+         * Splits path string into names of elements.
+         */
+        ElementPath(const char *path);
+
+        ~ElementPath(void);
+
+        /**
+         * Checks if element at given depth (top-level element has
+         * depth 1) is an ancestor of path target, the target itself
+         * or lies inside the target subtree.
+         */
+        relation relate(ElementNode *e, int depth);
+    };
+
+    /**
+     * Interface for consumers of completed subtrees.
+     *
+     * @see XmlParser::add_handler()
+     */
+    class SubtreeHandler {
+    public:
+        virtual ~SubtreeHandler(void);
+
+        /**
+         * Called when element has been completely read, right before
+         * it is detached from the document tree. Subtree holds no
+         * shared nodes (see XmlNode::is_shared()) even with subtree
+         * sharing, so handler may change it.
+         *
+         * @return True if parser should free the subtree, false if
+         * handler takes ownership of it.
+         */
+        virtual bool handle(ElementNode *e) = 0;
+    };
+
+    /**
+     * Bytes of document taken by element, from the start of its
+     * opening tag to the end of its closing tag.
+     *
+     * @see XmlParser::record_ranges()
+     */
+    struct ElementRange {
+        ElementNode *element;
+        unsigned long begin;
+        unsigned long end;
+    };
+
+    /**
+     * Element ranges in document order of opening tags.
+     */
+    typedef Vector <ElementRange> RangeList;
+
+   /**
+    * XML parser class.
+    *
+    * Utilizes XmlLexer to parse input stream into a list of tokens
+    * which are translated into a tree of ElementNode objects.
+    *
+    * Portions of XML data are fed to parser using input operator.
+    * XmlParser::is_finished() method is used to check if parsing is
+    * complete.
+    */
+    class XmlParser
+    {
+    private:
+        XmlLexer *lexer;
+
+        /**
+         * Root element contains just top-level element of the XML
+         * document.
+         *
+         * @see XmlParser::top()
+         */
+        ElementNode *root;
+
+        /**
+         * Stack of open elements.
+         *
+         * Closing tags are checked against names of these elements.
+         */
+        Vector <ElementNode *> *stack;
+
+        /**
+         * XML element currently being read.
+         */
+        ElementNode *current_node;
+
+        /**
+         * Query and handler pair registered with add_handler().
+         */
+        struct PathHandler {
+            Query *query;
+            SubtreeHandler *handler;
+
+            /**
+             * True if query was compiled by parser itself.
+             */
+            bool owned;
+        };
+
+        List <PathHandler *> *handlers;
+
+        /**
+         * Last text node of current element if no element tags have
+         * been read since it was added, 0 otherwise.
+         */
+        TextNode *open_text;
+
+        /**
+         * True if text fragments are merged into open_text.
+         */
+        bool coalesce_text;
+
+        whitespace_mode space_mode;
+
+        /**
+         * True if whitespace has been read in text run in
+         * NORMALIZE_SPACE mode and not yet written.
+         */
+        bool pending_space;
+
+        /**
+         * Worker token for whitespace, which is told to discard its
+         * contents when they are not needed.
+         */
+        SpaceToken *space_token;
+
+        /**
+         * Worker token for tags.
+         */
+        TagToken *tag_token;
+
+        /**
+         * True if attributes are split only when accessed.
+         */
+        bool lazy_attributes;
+
+        /**
+         * Depth of elements whose contents are recorded instead of
+         * being built, 0 if all elements are built.
+         */
+        int lazy_depth;
+
+        /**
+         * True if lexer is recording contents of element on the top
+         * of stack.
+         */
+        bool recording;
+
+        /**
+         * Shared subtrees of document, 0 unless subtree sharing is
+         * enabled.
+         */
+        SubtreeCache *cache;
+
+        /**
+         * Open elements which handlers will take when they are
+         * completed. Tracked only with subtree sharing, since
+         * elements inside them are not interned.
+         */
+        Vector <ElementNode *> *records;
+
+        /**
+         * True if a handler query matches element @a e.
+         */
+        bool is_record(ElementNode *e);
+
+        /**
+         * List where element ranges are recorded, or 0.
+         */
+        RangeList *ranges;
+
+        /**
+         * Indices in XmlParser::ranges of elements on stack.
+         */
+        Vector <int> *open_ranges;
+
+        /**
+         * Record range of element whose opening tag has just been
+         * read.
+         */
+        void add_range(ElementNode *e, unsigned long end);
+
+        /**
+         * Pop current element from stack and complete it.
+         */
+        void close_element(void);
+
+        /**
+         * Pass completed element to handlers or, if none takes it and
+         * it is not inside an element handlers will take, replace it
+         * with equal shared subtree.
+         */
+        void complete_element(ElementNode *e);
+
+        /**
+         * Append text collapsing whitespace runs in NORMALIZE_SPACE
+         * mode.
+         */
+        void add_normalized_text(String &s);
+
+#ifdef QWE_STATS
+        /**
+         * Record lengths of element name and attribute values and
+         * depth of element being opened.
+         */
+        void count_element(ElementNode *e);
+#endif
+
+        /**
+         * Add character data to current element, extending open text
+         * node if possible.
+         *
+         * New text node takes over buffer of @a s (usually contents of
+         * worker token), leaving it empty.
+         */
+        void add_text(String &s);
+
+        /**
+         * Paths set with include_path() and exclude_path().
+         */
+        List <ElementPath *> *includes;
+        List <ElementPath *> *excludes;
+
+        /**
+         * Check if newly attached element at given depth must be
+         * dropped according to projection paths.
+         */
+        bool is_projected_out(ElementNode *e, int depth);
+
+        /**
+         * Check if text in current element must be dropped according
+         * to projection paths.
+         */
+        bool is_text_projected_out(void);
+
+        /**
+         * Pass just completed element to the first handler with
+         * matching query, then evict it from the tree.
+         *
+         * @return True if element has been passed to a handler.
+         */
+        bool dispatch(ElementNode *e);
+
+        /**
+         * Memory used by document tree and pending tokens.
+         */
+        MemoryAccount memory;
+
+        /**
+         * Memory used by parser itself after construction or the last
+         * reset(), without document tree.
+         */
+        size_t baseline;
+
+        /**
+         * Read tokens from stream until its end, an error or until
+         * @a max_tokens tokens have been read (0 for no limit).
+         */
+        feed_status read_tokens(std::istream &in, unsigned long max_tokens);
+
+        /**
+         * Complete error recorded by lexer with current depth.
+         *
+         * @return False for use in feed().
+         */
+        bool fail(void);
+
+        /**
+         * Record error of document structure at the last tag.
+         */
+        void fail(error_type type);
+    public:
+        XmlParser(void);
+
+        ~XmlParser(void);
+
+        /**
+         * Reads a portion of XML data from input stream and updates
+         * XmlParser::root.
+         *
+         * New elements are added into the tree as opening tags occur
+         * in the input stream.
+         *
+         * @return False if input is malformed or memory budget is
+         * exceeded, see get_error(). Once an error has occured, feed()
+         * returns false without reading anything until reset().
+         *
+         * @see XmlParser::is_finished()
+         */
+        bool feed(std::istream &in);
+
+        /**
+         * Reads a bounded portion of XML data, so that parsing of
+         * many documents may be interleaved in one thread.
+         *
+         * At most @a max_bytes characters are taken from stream and at
+         * most @a max_tokens tokens are read, 0 meaning no limit. A
+         * token cut by the byte budget is kept unfinished like at the
+         * end of input and continued by the next call.
+         *
+         * @return MORE_PENDING if budget has run out while stream
+         * still has data, FEED_OK if stream has been read to the end
+         * and FEED_ERROR like feed().
+         */
+        feed_status feed(std::istream &in, unsigned long max_bytes,
+                         unsigned long max_tokens = 0);
+
+        /**
+         * Error which stopped parsing, with PARSE_OK type if there
+         * was none.
+         */
+        const ParseError& get_error(void);
+
+        /**
+         * Drops document tree and error to parse a new document.
+         *
+         * Parser returns to the state it had after construction and
+         * configuration: handlers, projection paths, whitespace mode
+         * and memory budget are kept. Allocated buffers are kept too,
+         * so reusing a parser is cheaper than constructing a new one.
+         * Peak memory usage starts over.
+         *
+         * @see ParserPool
+         */
+        void reset(void);
+
+        /**
+         * Limits memory used by document tree and pending tokens.
+         *
+         * Memory is accounted for strings, list cells and nodes
+         * allocated while parser is constructed or fed. When usage
+         * exceeds the budget, feed() stops after current token and
+         * returns false with MEMORY_LIMIT error. Subtrees passed to
+         * handlers give their memory back to the budget whether they
+         * are freed by parser or kept by handler (see
+         * XmlNode::get_memory_size()); allocations made by handlers
+         * themselves are not counted.
+         *
+         * @param bytes Budget in bytes, 0 (default) for unlimited.
+         */
+        void set_memory_budget(size_t bytes);
+
+        /**
+         * Bytes currently used by parser.
+         */
+        size_t get_memory_used(void);
+
+        /**
+         * Largest memory usage seen so far.
+         */
+        size_t get_memory_peak(void);
+
+        /**
+         * True if memory budget has been exceeded.
+         */
+        bool is_over_budget(void);
+
+        /**
+         * Checks if parsing is complete.
+         *
+         * @return True if current top-level element has been
+         * completely read from opening to closing tag
+         */
+        bool is_finished(void);
+
+        /**
+         * First top-level element.
+         */
+        XmlNode* top(void);
+
+        /**
+         * Pass ownership of finished top-level element to caller and
+         * reset parser for the next document. Memory used by the
+         * tree is given back to parser budget.
+         *
+         * @return Top-level element or 0 if document is not finished
+         * or has errors (parser is left as is then).
+         */
+        ElementNode* take_top(void);
+
+        /**
+         * Turns finished document into immutable Document which may
+         * be read by many threads, and resets parser for the next
+         * document.
+         *
+         * Lazy attributes and subtrees are built first, so freezing a
+         * lazily parsed document takes time proportional to its size.
+         *
+         * @return Document holding one reference for the caller, or 0
+         * like take_top().
+         */
+        Document* freeze(void);
+
+        /**
+         * Appends checkpoint of incremental parsing state to @a out.
+         *
+         * Checkpoint is a compact blob holding position in document,
+         * state of token being read (like partial attribute key or
+         * value) and open elements with their attributes and
+         * completed children. Another parser, even in another
+         * process, may load it with restore() and continue feeding
+         * exactly where this one stopped: the next byte fed must be
+         * the one at get_offset().
+         *
+         * Configuration (handlers, projection paths, whitespace and
+         * lazy modes, memory budget) is not saved, so restoring
+         * parser must be configured the same way. Shared subtrees are
+         * saved as separate copies and element ranges are not saved.
+         *
+         * @return False if parser has an error.
+         */
+        bool save(String &out);
+
+        /**
+         * Resets parser and loads checkpoint written by save().
+         *
+         * @return False if checkpoint is malformed, parser is left
+         * reset then.
+         */
+        bool restore(const char *s, size_t n);
+
+        /**
+         * Bytes of document read so far.
+         */
+        unsigned long get_offset(void);
+
+        /**
+         * Records byte range of every element added to the tree into
+         * @a r (which parser does not own), or stops recording if @a
+         * r is 0. Offsets count from the start of document.
+         *
+         * Ranges point to elements of the tree, so recording is meant
+         * for plain in-memory parsing, without handlers, lazy
+         * subtrees and subtree sharing.
+         *
+         * @see EditableDocument
+         */
+        void record_ranges(RangeList *r);
+
+        /**
+         * Registers handler for elements selected by query.
+         *
+         * When closing tag of such element is read, the element is
+         * passed to SubtreeHandler::handle() and evicted from the
+         * document tree, so memory used by parser stays proportional
+         * to the size of one record instead of the whole document.
+         * Records kept by handlers leave parser memory account, and
+         * with subtree sharing nothing inside them is cached, so the
+         * bound holds whatever handlers do with records. Handlers are
+         * tried in order of registration, the first one with matching
+         * query wins.
+         *
+         * Elements are matched with Query::matches() as soon as they
+         * are completed. Positional predicates only count siblings
+         * which are still in the tree, that is, not evicted by
+         * handlers.
+         *
+         * Parser does not take ownership of query and handler
+         * objects.
+         */
+        void add_handler(Query *q, SubtreeHandler *h);
+
+        /**
+         * Compiles query string (usually a plain absolute path like
+         * <code>/catalog/item</code>) and registers handler for it.
+         * Relative query starts from document, so <code>item</code>
+         * only matches top-level element named @c item.
+         *
+         * @return False if query string is invalid.
+         */
+        bool add_handler(const char *query, SubtreeHandler *h);
+
+        /**
+         * Restricts document tree to subtrees at given absolute path.
+         *
+         * When at least one include path is set, only elements on the
+         * way to included subtrees and the subtrees themselves are
+         * built. Text is only kept inside included subtrees.
+         */
+        void include_path(const char *path);
+
+        /**
+         * Drops subtrees at given absolute path from document tree.
+         *
+         * Contents of excluded elements are skipped by lexer without
+         * creating any nodes or strings.
+         */
+        void exclude_path(const char *path);
+
+        /**
+         * Controls merging of text split between portions of input.
+         *
+         * Text and CDATA tokens end when input portion ends, so a
+         * text read in several feeds comes in several fragments. By
+         * default fragments (including whitespace between them) are
+         * appended to the preceding text node, so every logical text
+         * node has a single contiguous buffer. When disabled, every
+         * fragment becomes a separate TextNode.
+         */
+        void set_text_coalescing(bool on);
+
+        /**
+         * Selects how whitespace is handled:
+         *
+         * - DISCARD_SPACE (default): whitespace-only runs between
+         *   markup are skipped without copying, whitespace inside text
+         *   is kept as is;
+         *
+         * - PRESERVE_SPACE: whitespace-only runs become text nodes
+         *   too, so all character data is kept;
+         *
+         * - NORMALIZE_SPACE: whitespace-only runs are skipped, runs
+         *   of whitespace inside text are replaced with one space and
+         *   text is trimmed.
+         */
+        void set_whitespace_mode(whitespace_mode m);
+
+        /**
+         * Turns lazy attribute parsing on or off (default).
+         *
+         * When enabled, attributes of each element are kept as one
+         * raw string and split into AttrNode objects only when
+         * attributes_begin() or another attribute accessor of the
+         * element is first called. Tags are still completely
+         * validated while read. This saves allocations for documents
+         * whose consumers read few attributes. Must be set before
+         * the first feed().
+         *
+         * Attributes split by handlers are allocated outside of
+         * parser memory account like any other handler allocations.
+         */
+        void set_lazy_attributes(bool on);
+
+        /**
+         * Builds only the top @a n levels of document eagerly.
+         *
+         * Contents of elements at depth @a n (top-level element has
+         * depth 1) are only scanned for tag balance and stored as raw
+         * markup (see ElementNode::set_raw_children()). They are
+         * built into children when first accessed through children
+         * iterators or other child accessors, again one level at a
+         * time. Documents which are only inspected shallowly thus
+         * take a fraction of time and allocations.
+         *
+         * Markup inside lazy elements is fully checked only when it
+         * is built; if it is malformed, no children are built and the
+         * element keeps its raw markup, so has_raw_children() tells
+         * about the error. Lazy levels are built by a nested parser
+         * with the text, whitespace and attribute settings this
+         * parser had, without projection paths and handlers. The
+         * builder is installed for all elements when the library is
+         * loaded, not by this method. Nodes it builds are charged to
+         * the memory account current in the thread which accesses
+         * them (see MemoryScope), not to this parser, which only
+         * accounts raw markup. Handlers see lazy elements as complete
+         * when their closing tag is read.
+         *
+         * @param n Number of eager levels, 0 (default) to build all.
+         */
+        void set_lazy_depth(int n);
+
+        /**
+         * Turns sharing of repeated subtrees on or off (default).
+         *
+         * When enabled, every completed element which is not taken by
+         * a handler, nor inside an element which will be, is looked
+         * up in a SubtreeCache by its structural hash. If an equal
+         * subtree has already been read, the new element is freed and
+         * the cached one is shared in its place (see
+         * XmlNode::share()), so documents with many repeated blocks
+         * keep one copy of each. Shared subtrees are read-only, and
+         * their parent is the first element which holds them. Since
+         * children are shared before their parents, comparing
+         * elements takes time proportional to the number of children,
+         * not the subtree size. Subtrees passed to handlers hold no
+         * shared nodes, and the cache does not keep their parts alive
+         * after handlers free them.
+         *
+         * Cache is cleared by reset(). Must be set before the first
+         * feed().
+         */
+        void set_subtree_sharing(bool on);
+
+        /**
+         * Number of distinct subtrees in cache.
+         */
+        int get_shared_count(void);
+
+#ifdef QWE_STATS
+        /**
+         * Statistics collected over all feeds.
+         */
+        ParserStats& get_stats(void);
+#endif
+    };
+
+    /**
+     * Stream buffer reading characters from memory without copying,
+     * so that parser may be fed from a string.
+     */
+    class MemoryBuffer : public std::streambuf {
+    public:
+        MemoryBuffer(const char *s, size_t n);
+    };
+
+    /**
+     * Stream buffer passing at most given number of characters from
+     * another stream buffer, then reporting end of input.
+     *
+     * Characters are read from source in blocks of what source
+     * already holds, and those read ahead but not consumed are put
+     * back to source when buffer is destroyed.
+     */
+    class BoundedBuffer : public std::streambuf {
+    private:
+        /**
+         * Characters kept before the get position for putback.
+         */
+        enum {PUTBACK = 8};
+
+        std::streambuf *source;
+
+        /**
+         * Characters which may still be taken from source.
+         */
+        unsigned long remaining;
+
+        char block[4096];
+
+    protected:
+        int underflow(void);
+
+    public:
+        BoundedBuffer(std::streambuf *s, unsigned long n);
+
+        ~BoundedBuffer(void);
+
+        /**
+         * True if all allowed characters have been taken and
+         * consumed.
+         */
+        bool is_exhausted(void);
     };
 
     /**
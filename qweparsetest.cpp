@@ -11,13 +11,20 @@ std::string finished_string(XmlParser *p)
 
 /**
  * Read XML from standard input and print it back to standard output.
+ *
+ * Optional argument selects whitespace mode: @c preserve or
+ * @c normalize.
  */
-int main()
+int main(int argc, char **argv)
 {
     /// @todo Find out why paring fails with smaller values
     const int buf_size = 128;
 
     XmlParser *p = new XmlParser();
+    if (argc > 1 && std::string(argv[1]) == "preserve")
+        p->set_whitespace_mode(PRESERVE_SPACE);
+    else if (argc > 1 && std::string(argv[1]) == "normalize")
+        p->set_whitespace_mode(NORMALIZE_SPACE);
     char buffer[buf_size];
     std::istringstream *is;
 
@@ -25,13 +32,22 @@ int main()
     {
         is = new std::istringstream();
         is->str(buffer);
-        *is >> *p;
-
-        if (p->top())
+        if (!p->feed(*is))
+        {
+            const ParseError &e = p->get_error();
+            std::cout << ":: ERROR: " << error_message(e.type) \
+                      << " at " << e.line << ":" << e.column \
+                      << " (offset " << e.offset << ", depth " \
+                      << e.depth << ")" << std::endl;
+            p->reset();
+        }
+        else if (p->top())
         {
             std::cout << ":: " << finished_string(p) << ": ";
             std::cout << p->top()->get_printable() << std::endl;
         }
+        delete is;
     }
+    delete p;
     return 0;
 }
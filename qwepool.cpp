@@ -0,0 +1,68 @@
+#include "qwepool.hpp"
+
+namespace qwe {
+    ParserFactory::~ParserFactory(void)
+    {}
+
+    XmlParser* ParserFactory::create(void)
+    {
+        return new XmlParser();
+    }
+
+    ParserPool::ParserPool(ParserFactory *f, int max)
+        :factory(f ? f : &default_factory), max_idle(max)
+    {
+        idle = new List <XmlParser *>;
+    }
+
+    ParserPool::~ParserPool(void)
+    {
+        while (!idle->is_empty())
+        {
+            delete idle->last_item();
+            idle->pop_item();
+        }
+        delete idle;
+    }
+
+    /**
+     * New parsers are created outside the lock.
+     */
+    XmlParser* ParserPool::acquire(void)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!idle->is_empty())
+            {
+                XmlParser *p = idle->last_item();
+                idle->pop_item();
+                return p;
+            }
+        }
+        return factory->create();
+    }
+
+    /**
+     * Parser is reset before taking the lock, so threads do not wait
+     * for each other's documents to be freed.
+     */
+    void ParserPool::release(XmlParser *p)
+    {
+        p->reset();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (idle->get_length() < max_idle)
+            {
+                idle->push_item(p);
+                return;
+            }
+        }
+        delete p;
+    }
+
+    int ParserPool::get_idle_count(void)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return idle->get_length();
+    }
+}
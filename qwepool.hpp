@@ -0,0 +1,82 @@
+#ifndef QWE_POOL_H
+#define QWE_POOL_H
+#include <mutex>
+#include "qweparse.hpp"
+
+namespace qwe {
+    /**
+     * Creates and configures parsers for ParserPool.
+     *
+     * Default implementation creates parsers with default settings.
+     */
+    class ParserFactory {
+    public:
+        virtual ~ParserFactory(void);
+
+        /**
+         * Construct new parser and set up its handlers, projection
+         * paths and other options.
+         */
+        virtual XmlParser* create(void);
+    };
+
+    /**
+     * Thread-safe pool of reusable parsers.
+     *
+     * Parsers are taken with acquire() and given back with release(),
+     * which resets them keeping allocated buffers, so parsing a
+     * message takes neither construction of a parser nor growing of
+     * its buffers. All parsers in a pool are configured by the same
+     * factory; since reset() keeps configuration, users must not
+     * change it.
+     */
+    class ParserPool {
+    private:
+        ParserFactory *factory;
+
+        /**
+         * Default factory used when none is given.
+         */
+        ParserFactory default_factory;
+
+        /**
+         * Parsers ready to be acquired.
+         */
+        List <XmlParser *> *idle;
+
+        /**
+         * Maximum number of idle parsers kept by pool.
+         */
+        int max_idle;
+
+        std::mutex lock;
+    public:
+        /**
+         * @param f Factory for new parsers, 0 for default one. Pool
+         * does not take ownership of it.
+         *
+         * @param max Maximum number of idle parsers; extra ones are
+         * deleted when released.
+         */
+        ParserPool(ParserFactory *f = 0, int max = 16);
+
+        /**
+         * Deletes idle parsers. Parsers which are still acquired are
+         * not owned by pool.
+         */
+        ~ParserPool(void);
+
+        /**
+         * Take idle parser or create a new one.
+         */
+        XmlParser* acquire(void);
+
+        /**
+         * Reset parser and return it to the pool.
+         */
+        void release(XmlParser *p);
+
+        int get_idle_count(void);
+    };
+}
+#endif
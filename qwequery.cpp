@@ -0,0 +1,443 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include "qwequery.hpp"
+
+namespace qwe {
+    /**
+     * Returns true if character may be used in names inside query.
+     */
+    static bool is_queryname(char c)
+    {
+        return isalnum(c) || c == '-' || c == '_';
+    }
+
+    /**
+     * Returns true if element is document root of parser-built tree,
+     * i.e. a nameless element without parent.
+     */
+    static bool is_document(ElementNode *e)
+    {
+        return (!e->get_parent() && e->get_name().is_empty());
+    }
+
+    Query::Predicate::Predicate(void)
+        :type(HAS_ATTR), position(0)
+    {}
+
+    bool Query::Predicate::accepts(ElementNode *e, int pos)
+    {
+        AttrNode *a;
+        switch (type)
+        {
+        case POSITION:
+            return (pos == position);
+        case HAS_ATTR:
+            return (e->find_attribute(name) != 0);
+        case ATTR_EQUALS:
+            a = e->find_attribute(name);
+            return (a && a->get_value() == value);
+        }
+        return false;
+    }
+
+    Query::Step::Step(void)
+        :type(CHILD), name(0), positional(false)
+    {}
+
+    Query::Step::~Step(void)
+    {
+        List <Predicate *>::StlIterator i = predicates.begin(),
+            end = predicates.end();
+        while (i != end)
+        {
+            delete *i;
+            i++;
+        }
+        delete name;
+    }
+
+    bool Query::Step::test_name(ElementNode *e)
+    {
+        return (!name || *name == e->get_name());
+    }
+
+    bool Query::Step::test_predicates(ElementNode *e, int *reached)
+    {
+        List <Predicate *>::StlIterator p = predicates.begin(),
+            end = predicates.end();
+        for (int k = 0; p != end; k++, p++)
+            if (!(*p)->accepts(e, ++reached[k]))
+                return false;
+        return true;
+    }
+
+    /**
+     * Positions are counted in one pass over preceding siblings,
+     * which is skipped if step has no positional predicate. Pass
+     * stops once more candidates have come to a positional
+     * predicate than its position, since @a e would come after
+     * them.
+     */
+    bool Query::Step::selects(ElementNode *context, ElementNode *e)
+    {
+        if (!test_name(e))
+            return false;
+
+        SmallVector <int, 4> reached;
+        for (int k = 0; k < predicates.get_length(); k++)
+            reached.push_item(0);
+        if (!reached.get_length())
+            return true;
+        if (!context || !positional)
+            return test_predicates(e, &reached[0]);
+
+        NodeList::StlIterator i = context->children_begin(),
+            end = context->children_end();
+        for (; i != end && *i != e; i++)
+        {
+            if ((*i)->get_type() != ELEMENT_NODE || \
+                !test_name((ElementNode *)(*i)))
+                continue;
+            test_predicates((ElementNode *)(*i), &reached[0]);
+
+            List <Predicate *>::StlIterator p = predicates.begin(),
+                pend = predicates.end();
+            for (int k = 0; p != pend; k++, p++)
+                if ((*p)->type == Predicate::POSITION && \
+                    reached[k] >= (*p)->position)
+                    return false;
+        }
+        return i != end && test_predicates(e, &reached[0]);
+    }
+
+    /**
+     * Candidates are first filtered by name, then each predicate is
+     * applied in turn, so that positions in a predicate are counted
+     * among elements which passed previous ones. Two buffers are
+     * swapped between predicates.
+     */
+    void Query::Step::select(ElementNode *context, ElementNode *top,
+                             ElementList &result)
+    {
+        ElementList buffers[2];
+        ElementList *candidates = &buffers[0], *passed = &buffers[1];
+
+        if (!context)
+        {
+            if (test_name(top))
+                candidates->push_item(top);
+        }
+        else
+        {
+            NodeList::StlIterator i = context->children_begin(),
+                end = context->children_end();
+            while (i != end)
+            {
+                if ((*i)->get_type() == ELEMENT_NODE && \
+                    test_name((ElementNode *)(*i)))
+                    candidates->push_item((ElementNode *)(*i));
+                i++;
+            }
+        }
+
+        List <Predicate *>::StlIterator p = predicates.begin(),
+            pend = predicates.end();
+        while (p != pend && !candidates->is_empty())
+        {
+            passed->clear();
+            for (int pos = 1; pos <= candidates->get_length(); pos++)
+            {
+                if ((*p)->accepts((*candidates)[pos - 1], pos))
+                    passed->push_item((*candidates)[pos - 1]);
+            }
+            ElementList *t = candidates;
+            candidates = passed;
+            passed = t;
+            p++;
+        }
+
+        for (int i = 0; i < candidates->get_length(); i++)
+            result.push_item((*candidates)[i]);
+    }
+
+    Query::Query(void)
+        :absolute(false)
+    {}
+
+    Query::~Query(void)
+    {
+        Vector <Step *>::StlIterator i = steps.begin(), end = steps.end();
+        while (i != end)
+        {
+            delete *i;
+            i++;
+        }
+    }
+
+    Query* Query::compile(const char *expr)
+    {
+        Query *q = new Query();
+        if (!q->parse(expr))
+        {
+            delete q;
+            return 0;
+        }
+        return q;
+    }
+
+    /**
+     * Recursive descent over grammar given in class description.
+     */
+    bool Query::parse(const char *expr)
+    {
+        const char *c = expr;
+        axis next_axis = CHILD;
+
+        if (*c == '/')
+        {
+            absolute = true;
+            c++;
+            if (*c == '/')
+            {
+                next_axis = DESCENDANT;
+                c++;
+            }
+        }
+
+        while (true)
+        {
+            Step *s = new Step();
+            steps.push_item(s);
+            s->type = next_axis;
+
+            /// Name test
+            if (*c == '*')
+                c++;
+            else if (is_queryname(*c))
+            {
+                s->name = new String();
+                while (is_queryname(*c))
+                    s->name->append(*c++);
+            }
+            else
+                return false;
+
+            /// Predicates
+            while (*c == '[')
+            {
+                Predicate *p = new Predicate();
+                s->predicates.push_item(p);
+                c++;
+                if (isdigit(*c))
+                {
+                    p->type = Predicate::POSITION;
+                    p->position = strtol(c, (char **)(&c), 10);
+                    s->positional = true;
+                }
+                else if (*c == '@')
+                {
+                    c++;
+                    if (!is_queryname(*c))
+                        return false;
+                    while (is_queryname(*c))
+                        p->name.append(*c++);
+                    p->type = Predicate::HAS_ATTR;
+                    if (*c == '=')
+                    {
+                        char quote = *(++c);
+                        if (quote != '"' && quote != '\'')
+                            return false;
+                        c++;
+                        while (*c && *c != quote)
+                            p->value.append(*c++);
+                        if (*c++ != quote)
+                            return false;
+                        p->type = Predicate::ATTR_EQUALS;
+                    }
+                }
+                else
+                    return false;
+                if (*c++ != ']')
+                    return false;
+            }
+
+            /// Separator before next step
+            if (*c == 0)
+                return true;
+            if (*c++ != '/')
+                return false;
+            next_axis = CHILD;
+            if (*c == '/')
+            {
+                next_axis = DESCENDANT;
+                c++;
+            }
+        }
+    }
+
+    /**
+     * Descendant steps visit every element below each context node.
+     * Context nodes lying inside subtree of previous context are
+     * skipped, so that every element is selected only once and
+     * results stay in document order.
+     */
+    void Query::apply(Step *s, ElementList &context, ElementNode *top,
+                      ElementList &result)
+    {
+        ElementList::StlIterator i = context.begin(), end = context.end();
+        ElementNode *last = 0;
+        bool has_last = false;
+
+        while (i != end)
+        {
+            ElementNode *ctx = *i;
+            i++;
+            if (s->type == CHILD)
+            {
+                s->select(ctx, top, result);
+                continue;
+            }
+
+            if (has_last)
+            {
+                if (!last)
+                    continue;
+                XmlNode *n = ctx;
+                while (n && n != last)
+                    n = n->get_parent();
+                if (n)
+                    continue;
+            }
+            last = ctx;
+            has_last = true;
+
+            /// Depth-first walk using explicit stack of contexts
+            ElementList todo;
+            todo.push_item(ctx);
+            while (!todo.is_empty())
+            {
+                ElementNode *n = todo.last_item();
+                todo.pop_item();
+
+                ElementList selected;
+                s->select(n, top, selected);
+
+                /// Merge selected children into result in document
+                /// order and schedule all element children for
+                /// visiting, first child on top of the stack.
+                ElementList::StlIterator si = selected.begin(),
+                    send = selected.end();
+                ElementList children;
+                if (!n)
+                    children.push_item(top);
+                else
+                {
+                    NodeList::StlIterator c = n->children_begin(),
+                        cend = n->children_end();
+                    while (c != cend)
+                    {
+                        if ((*c)->get_type() == ELEMENT_NODE)
+                            children.push_item((ElementNode *)(*c));
+                        c++;
+                    }
+                }
+                ElementList::StlIterator c = children.begin(),
+                    cend = children.end();
+                while (c != cend)
+                {
+                    if (si != send && *si == *c)
+                    {
+                        result.push_item(*c);
+                        si++;
+                    }
+                    c++;
+                }
+                c = children.rbegin();
+                cend = children.rend();
+                while (c != cend)
+                {
+                    todo.push_item(*c);
+                    c--;
+                }
+            }
+        }
+    }
+
+    void Query::evaluate(ElementNode *context, ElementList &result)
+    {
+        ElementList *current = new ElementList(), *next;
+        ElementNode *top = 0;
+
+        if (absolute)
+        {
+            ElementNode *d = context;
+            while (d->get_parent())
+                d = (ElementNode *)(d->get_parent());
+            if (is_document(d))
+                current->push_item(d);
+            else
+            {
+                /// Tree built by hand has no document node, so its
+                /// topmost element is the only child of virtual one
+                current->push_item(0);
+                top = d;
+            }
+        }
+        else
+            current->push_item(context);
+
+        Vector <Step *>::StlIterator s = steps.begin(), end = steps.end();
+        while (s != end)
+        {
+            next = new ElementList();
+            apply(*s, *current, top, *next);
+            delete current;
+            current = next;
+            s++;
+        }
+
+        ElementList::StlIterator i = current->begin(), iend = current->end();
+        while (i != iend)
+        {
+            result.push_item(*i);
+            i++;
+        }
+        delete current;
+    }
+
+    bool Query::matches(ElementNode *e)
+    {
+        return match_from(steps.get_length() - 1, e);
+    }
+
+    /**
+     * Steps are matched from the last one up, following parent
+     * links. Descendant steps try every ancestor in turn.
+     */
+    bool Query::match_from(int k, ElementNode *e)
+    {
+        Step *s = steps[k];
+
+        ElementNode *parent = (ElementNode *)(e->get_parent());
+        bool at_document = (!parent || is_document(parent));
+
+        /// Check that element is selected among its siblings
+        if (!s->selects(parent, e))
+            return false;
+
+        if (k == 0)
+            return (at_document || s->type == DESCENDANT);
+        if (at_document)
+            return false;
+        if (s->type == CHILD)
+            return match_from(k - 1, parent);
+
+        for (ElementNode *a = parent; a && !is_document(a);
+             a = (ElementNode *)(a->get_parent()))
+        {
+            if (match_from(k - 1, a))
+                return true;
+        }
+        return false;
+    }
+}
@@ -0,0 +1,176 @@
+#ifndef QWE_QUERY_H
+#define QWE_QUERY_H
+#include "qwelist.hpp"
+#include "qwevector.hpp"
+#include "qwestring.hpp"
+#include "qwexml.hpp"
+
+/**
+ * Path queries over element trees.
+ */
+
+namespace qwe {
+    typedef Vector <ElementNode *> ElementList;
+
+    /**
+     * Compiled path query.
+     *
+     * Supports a small subset of XPath abbreviated syntax:
+     *
+     @verbatim
+     Query     ::= ('/' | '//')? Step (('/' | '//') Step)*
+     Step      ::= (Name | '*') Predicate*
+     Predicate ::= '[' (Number | '@' Name ('=' Literal)?) ']'
+     Literal   ::= '"' [^"]* '"' | "'" [^']* "'"
+@endverbatim
+     *
+     * Examples: <code>/catalog/item</code>,
+     * <code>//item[@id="42"]</code>, <code>/catalog/item[2]/name</code>.
+     *
+     * Positional predicates count element siblings which passed name
+     * test and preceding predicates of the same step, starting from 1.
+     *
+     * Query string is parsed once by Query::compile() and the
+     * resulting plan may be evaluated any number of times.
+     */
+    class Query {
+    private:
+        enum axis {CHILD, DESCENDANT};
+
+        /**
+         * Step predicate.
+         */
+        class Predicate {
+        public:
+            enum kind {POSITION, HAS_ATTR, ATTR_EQUALS};
+
+            kind type;
+
+            /**
+             * Position to accept, 0 for attribute predicates.
+             */
+            int position;
+            String name;
+            String value;
+
+            Predicate(void);
+
+            /**
+             * Check element which is @a pos-th among candidates.
+             */
+            bool accepts(ElementNode *e, int pos);
+        };
+
+        /**
+         * Location step.
+         */
+        class Step {
+        public:
+            axis type;
+
+            /**
+             * Name to test, 0 for wildcard.
+             */
+            String *name;
+
+            List <Predicate *> predicates;
+
+            /**
+             * True if step has a positional predicate.
+             */
+            bool positional;
+
+            Step(void);
+
+            ~Step(void);
+
+            bool test_name(ElementNode *e);
+
+            /**
+             * Apply predicates to element which passed name test,
+             * counting it in @a reached, the number of candidates
+             * which have come to each predicate so far.
+             */
+            bool test_predicates(ElementNode *e, int *reached);
+
+            /**
+             * Check if @a e is selected among children of @a
+             * context, looking only at its preceding siblings.
+             *
+             * When @a context is 0, @a e is considered to be the only
+             * child of document.
+             */
+            bool selects(ElementNode *context, ElementNode *e);
+
+            /**
+             * Collect element children of @a context passing name
+             * test and all predicates.
+             *
+             * When @a context is 0, @a top is considered to be the
+             * only child of document.
+             */
+            void select(ElementNode *context, ElementNode *top,
+                        ElementList &result);
+        };
+
+        Vector <Step *> steps;
+
+        /**
+         * True if query starts from document root.
+         */
+        bool absolute;
+
+        Query(void);
+
+        /**
+         * Fill Query::steps from query string.
+         *
+         * @return False if string is not a valid query.
+         */
+        bool parse(const char *expr);
+
+        /**
+         * Check if @a e is selected by step @a k when its context is
+         * matched by the preceding steps.
+         */
+        bool match_from(int k, ElementNode *e);
+
+        /**
+         * Apply step to each context node.
+         */
+        void apply(Step *s, ElementList &context, ElementNode *top,
+                   ElementList &result);
+
+    public:
+        ~Query(void);
+
+        /**
+         * Compile query string into reusable plan.
+         *
+         * @return New query object or 0 if @a expr has syntax errors.
+         */
+        static Query* compile(const char *expr);
+
+        /**
+         * Select elements matched by query into @a result in
+         * document order.
+         *
+         * Relative queries start from @a context, absolute ones from
+         * the document @a context belongs to.
+         */
+        void evaluate(ElementNode *context, ElementList &result);
+
+        /**
+         * Check if element would be selected by query evaluated over
+         * its document.
+         *
+         * Only element ancestors and preceding siblings are
+         * examined, so this works on partially built trees and is
+         * used by XmlParser to filter elements as they are completed.
+         * Relative queries are treated as starting from document
+         * root.
+         */
+        bool matches(ElementNode *e);
+    };
+}
+#endif
@@ -0,0 +1,159 @@
+#include <iostream>
+#include <sstream>
+#include "qweparse.hpp"
+#include "qwequery.hpp"
+
+using namespace qwe;
+
+int failed = 0;
+
+void check(bool cond, const char *name)
+{
+    if (cond)
+        std::cout << name << " test passed" << std::endl;
+    else
+    {
+        std::cout << name << " test FAILED" << std::endl;
+        failed++;
+    }
+}
+
+/**
+ * Evaluate query and join names of selected elements and values of
+ * their @c id attributes.
+ */
+std::string run(const char *expr, ElementNode *context)
+{
+    std::ostringstream out;
+    String id("id");
+    Query *q = Query::compile(expr);
+    if (!q)
+        return "INVALID";
+
+    ElementList result;
+    q->evaluate(context, result);
+    ElementList::StlIterator i = result.begin(), end = result.end();
+    while (i != end)
+    {
+        out << (*i)->get_name();
+        AttrNode *a = (*i)->find_attribute(id);
+        if (a)
+            out << a->get_value();
+        out << " ";
+        i++;
+    }
+    delete q;
+    return out.str();
+}
+
+/**
+ * Collects ids of handled elements.
+ */
+class IdCollector : public SubtreeHandler {
+public:
+    std::string ids;
+
+    bool handle(ElementNode *e)
+    {
+        String id("id");
+        std::ostringstream out;
+        out << e->find_attribute(id)->get_value();
+        ids += out.str();
+        return true;
+    }
+};
+
+/**
+ * Check that Query::matches() holds exactly for elements selected by
+ * evaluating query over the whole document.
+ */
+bool agrees(const char *expr, ElementNode *top)
+{
+    Query *q = Query::compile(expr);
+    ElementList result, todo;
+    q->evaluate(top, result);
+    bool same = true;
+    todo.push_item(top);
+    while (!todo.is_empty())
+    {
+        ElementNode *e = todo.last_item();
+        todo.pop_item();
+        bool selected = false;
+        for (int i = 0; i < result.get_length(); i++)
+            selected = selected || result[i] == e;
+        same = same && q->matches(e) == selected;
+        for (int i = 0; i < e->get_children_count(); i++)
+            if (e->get_child(i)->get_type() == ELEMENT_NODE)
+                todo.push_item((ElementNode *)(e->get_child(i)));
+    }
+    delete q;
+    return same;
+}
+
+int main()
+{
+    const char *xml =
+        "<lib><shelf id=\"1\"><book id=\"a\"/><book id=\"b\" lang=\"en\"/>"
+        "<box><book id=\"c\" lang=\"en\"/></box></shelf>"
+        "<shelf id=\"2\"><book id=\"d\"/></shelf></lib>";
+
+    XmlParser p;
+    std::istringstream is(xml);
+    is >> p;
+    ElementNode *top = (ElementNode *)(p.top());
+
+    check(run("/lib/shelf", top) == "shelf1 shelf2 ", "Child steps");
+    check(run("/lib/shelf/book", top) == "booka bookb bookd ", "Nested child steps");
+    check(run("//book", top) == "booka bookb bookc bookd ", "Descendant step");
+    check(run("/lib//book[@lang]", top) == "bookb bookc ", "Attribute predicate");
+    check(run("//shelf[@id=\"2\"]/book", top) == "bookd ", "Attribute value");
+    check(run("/lib/shelf[1]/book[2]", top) == "bookb ", "Positional predicate");
+    check(run("//book[@lang='en'][2]", top) == "", "Chained predicates");
+    check(run("/lib/*[2]/*", top) == "bookd ", "Wildcard");
+    check(run("//*//book", top) == "booka bookb bookc bookd ", "Nested descendants");
+    check(run("book", (ElementNode *)(top->first_child())) == "booka bookb ",
+          "Relative query");
+    check(run("/lib/[1]", top) == "INVALID", "Syntax error");
+
+    check(agrees("/lib/shelf[1]/book[2]", top) && \
+          agrees("//book[@lang][2]", top) && \
+          agrees("//book[@lang='en'][1]", top) && \
+          agrees("/lib/*[2]/*", top) && agrees("//*[2]", top) && \
+          agrees("//shelf/book[@id][2][@lang]", top), "Matching");
+
+    /// Tree built by hand has no document node
+    ElementNode *root = new ElementNode(String("root"));
+    ElementNode *leaf = new ElementNode(String("leaf"));
+    root->add_child(leaf);
+    check(run("/root/leaf", leaf) == "leaf ", "Hand-built tree");
+    delete root;
+
+    /// Streaming filter
+    {
+        XmlParser s;
+        IdCollector h;
+        Query *q = Query::compile("//book[@lang=\"en\"]");
+        s.add_handler(q, &h);
+        std::istringstream in(xml);
+        in >> s;
+        check(h.ids == "bc", "Streaming filter");
+        delete q;
+    }
+
+    /// Positional matching over many siblings
+    {
+        std::string many("<list>");
+        for (int i = 0; i < 5000; i++)
+            many += "<item id=\"" + std::to_string(i % 10) + "\"/><x/>";
+        many += "</list>";
+        XmlParser s;
+        std::istringstream in(many);
+        in >> s;
+        ElementNode *list = (ElementNode *)(s.top());
+        check(agrees("/list/item[@id='7'][2]", list) && \
+              agrees("/list/*[3]", list) && agrees("//x[@id]", list),
+              "Matching many siblings");
+    }
+
+    return failed;
+}
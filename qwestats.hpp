@@ -0,0 +1,47 @@
+#ifndef QWE_STATS_H
+#define QWE_STATS_H
+
+#include <stddef.h>
+
+/**
+ * Compile-time switch for parser instrumentation.
+ *
+ * When QWE_STATS is not defined, statistics code is removed
+ * completely and QWE_STAT() expands to nothing.
+ */
+
+#ifdef QWE_STATS
+#define QWE_STAT(x) x
+#else
+#define QWE_STAT(x)
+#endif
+
+namespace qwe {
+#ifdef QWE_STATS
+    /**
+     * Allocation counters of current thread.
+     *
+     * Updated by containers, strings and nodes whenever they allocate
+     * memory. XmlParser reads them before and after each feed to
+     * attribute allocations to itself.
+     */
+    struct AllocCounters {
+        unsigned long allocations;
+        unsigned long bytes;
+    };
+
+    inline AllocCounters& alloc_counters(void)
+    {
+        static thread_local AllocCounters counters = {0, 0};
+        return counters;
+    }
+
+    inline void count_alloc(size_t bytes)
+    {
+        AllocCounters &c = alloc_counters();
+        c.allocations++;
+        c.bytes += bytes;
+    }
+#endif
+}
+#endif
@@ -0,0 +1,825 @@
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "qweparse.hpp"
+#include "qwepool.hpp"
+#include "qweedit.hpp"
+#include "qwedriver.hpp"
+
+using namespace qwe;
+
+/**
+ * Handler which counts records and keeps names of their first
+ * children.
+ */
+class ItemCounter : public SubtreeHandler {
+public:
+    int count;
+    String names;
+
+    ItemCounter(void)
+        :count(0)
+    {}
+
+    bool handle(ElementNode *e)
+    {
+        count++;
+        if (e->has_children())
+            names += ((ElementNode *)(e->first_child()))->get_name();
+        return true;
+    }
+};
+
+int failed = 0;
+
+void check(bool cond, const char *name)
+{
+    if (cond)
+        std::cout << name << " test passed" << std::endl;
+    else
+    {
+        std::cout << name << " test FAILED" << std::endl;
+        failed++;
+    }
+}
+
+/**
+ * Stream handler which takes finished documents and records the end
+ * of stream.
+ */
+class StreamRecorder : public StreamHandler {
+public:
+    int feeds;
+    int documents;
+    bool ended;
+    error_type error;
+    String last;
+
+    StreamRecorder(void)
+        :feeds(0), documents(0), ended(false), error(PARSE_OK)
+    {}
+
+    void on_data(int fd, XmlParser *p)
+    {
+        feeds++;
+        if (p->top() && p->is_finished())
+        {
+            ElementNode *e = p->take_top();
+            last = e->get_printable();
+            delete e;
+            documents++;
+        }
+    }
+
+    void on_end(int fd, XmlParser *p, int e)
+    {
+        ended = true;
+        error = p->get_error().type;
+        close(fd);
+    }
+};
+
+/**
+ * Handler which takes records over and frees them later, outside of
+ * parser.
+ */
+class Keeper : public SubtreeHandler {
+public:
+    ElementNode *kept;
+
+    Keeper(void)
+        :kept(0)
+    {}
+
+    ~Keeper(void)
+    {
+        delete kept;
+    }
+
+    bool handle(ElementNode *e)
+    {
+        delete kept;
+        kept = e;
+        return false;
+    }
+};
+
+/**
+ * Handler which drops records, so it may be shared between threads.
+ */
+class Evictor : public SubtreeHandler {
+public:
+    bool handle(ElementNode *e)
+    {
+        return true;
+    }
+};
+
+/**
+ * Factory for parsers evicting /list/item records.
+ */
+class ListFactory : public ParserFactory {
+public:
+    Evictor evictor;
+
+    XmlParser* create(void)
+    {
+        XmlParser *p = new XmlParser();
+        p->add_handler("/list/item", &evictor);
+        return p;
+    }
+};
+
+/**
+ * Feed string to parser in chunks of given size.
+ */
+void feed_chunks(XmlParser &p, const char *xml, int chunk)
+{
+    std::string s(xml);
+    for (size_t i = 0; i < s.size(); i += chunk)
+    {
+        std::istringstream is(s.substr(i, chunk));
+        is >> p;
+    }
+}
+
+int main()
+{
+    const char *catalog =
+        "<catalog><item><a/></item><item><b>x</b></item>"
+        "<other><item><c/></item></other><item><d/></item></catalog>";
+
+    /// Evict records at /catalog/item, ignoring nested ones
+    {
+        XmlParser p;
+        ItemCounter h;
+        p.add_handler("/catalog/item", &h);
+        feed_chunks(p, catalog, 5);
+
+        String expected("abd"), other("other");
+        check(p.is_finished(), "Eviction finished");
+        check(h.count == 3, "Eviction count");
+        check(h.names == expected, "Eviction order");
+        ElementNode *top = (ElementNode *)(p.top());
+        check(((ElementNode *)(top->first_child()))->get_name() == other,
+              "Eviction detach");
+    }
+
+    /// Relative path starts from document, so it only matches top
+    {
+        XmlParser p, t;
+        ItemCounter h, ht;
+        p.add_handler("item", &h);
+        t.add_handler("item", &ht);
+        feed_chunks(p, catalog, 7);
+        feed_chunks(t, "<item><item/></item>", 7);
+        check(h.count == 0 && ht.count == 1 && t.is_finished() && \
+              !t.top(), "Relative path");
+    }
+
+    /// Projection
+    {
+        const char *wide =
+            "<doc><meta a=\"1>\">skip<x/><y><z>t</z></y>"
+            "<!-- </meta> --><![CDATA[</meta>]]></meta>"
+            "<body>keep<p>one</p><q>two</q></body>tail</doc>";
+
+        XmlParser p;
+        p.exclude_path("/doc/meta");
+        p.exclude_path("/doc/body/q");
+        feed_chunks(p, wide, 3);
+        check(p.is_finished(), "Exclusion finished");
+        String excluded("<doc><body>keep<p>one</p></body>tail</doc>");
+        check(p.top()->get_printable() == excluded, "Exclusion");
+
+        XmlParser i;
+        i.include_path("/doc/body/p");
+        feed_chunks(i, wide, 4);
+        check(i.is_finished(), "Inclusion finished");
+        String included("<doc><body><p>one</p></body></doc>");
+        check(i.top()->get_printable() == included, "Inclusion");
+    }
+
+    /// Text coalescing
+    {
+        const char *text = "<a>some  text &amp; <![CDATA[more]]> text</a>";
+        String expected("some  text & more text");
+
+        XmlParser p;
+        feed_chunks(p, text, 4);
+        ElementNode *top = (ElementNode *)(p.top());
+        check(top->first_child() == top->last_child(), "Coalescing");
+        check(((TextNode *)(top->first_child()))->get_contents() == expected,
+              "Coalesced contents");
+
+        XmlParser b;
+        feed_chunks(b, "<a>one  two</a>", 1);
+        top = (ElementNode *)(b.top());
+        String one_two("one  two");
+        check(((TextNode *)(top->first_child()))->get_contents() == one_two,
+              "Byte by byte coalescing");
+
+        XmlParser f;
+        f.set_text_coalescing(false);
+        feed_chunks(f, text, 4);
+        top = (ElementNode *)(f.top());
+        check(top->first_child() != top->last_child(), "Fragments");
+    }
+
+    /// Markup split between chunks right after <
+    {
+        std::string doc("<?xml version=\"1.0\"?><!DOCTYPE r>"
+                        "<r>a<!-- c -->b<?p d?><![CDATA[x]]><e/></r>");
+        XmlParser whole;
+        feed_chunks(whole, doc.c_str(), doc.size());
+        String expected = whole.top()->get_printable();
+
+        bool same = true;
+        for (size_t k = 1; k < doc.size() && same; k++)
+        {
+            XmlParser p;
+            feed_chunks(p, doc.substr(0, k).c_str(), k);
+            feed_chunks(p, doc.substr(k).c_str(), doc.size());
+            same = p.is_finished() && p.get_error().type == PARSE_OK && \
+                p.top()->get_printable() == expected;
+        }
+        check(same, "Split markup");
+    }
+
+    /// Memory accounting
+    {
+        XmlParser p;
+        ItemCounter h;
+        p.add_handler("/list/item", &h);
+        std::istringstream head("<list>");
+        p.feed(head);
+        size_t used = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            std::istringstream is("<item><a x=\"value\">some text</a></item>");
+            p.feed(is);
+            if (i == 10)
+                used = p.get_memory_used();
+        }
+        check(h.count == 1000, "Evicted records");
+        check(p.get_memory_used() == used, "Flat memory usage");
+        check(p.get_memory_peak() >= used, "Peak memory usage");
+
+        XmlParser k;
+        Keeper keeper;
+        k.add_handler("/list/item", &keeper);
+        k.set_memory_budget(1 << 16);
+        std::istringstream khead("<list>");
+        k.feed(khead);
+        bool fed = true;
+        for (int i = 0; i < 5000; i++)
+        {
+            std::istringstream is("<item><a x=\"value\">some text</a></item>");
+            fed = fed && k.feed(is);
+            if (i == 10)
+                used = k.get_memory_used();
+        }
+        check(fed && k.get_memory_used() == used, "Flat memory with kept records");
+
+        XmlParser b;
+        b.set_memory_budget(b.get_memory_used() + 4096);
+        std::istringstream small("<list><item>short</item>");
+        check(b.feed(small), "Within budget");
+        std::string big(10000, 'x');
+        std::istringstream large("<item>" + big + "</item>");
+        check(!b.feed(large) && b.is_over_budget(), "Over budget");
+        std::istringstream more("</list>");
+        check(!b.feed(more), "Feed after budget exceeded");
+        check(b.get_error().type == MEMORY_LIMIT, "Memory limit error");
+
+        b.reset();
+        std::istringstream again("<list><item>short</item></list>");
+        check(b.feed(again) && b.is_finished(), "Reuse after budget exceeded");
+
+        /// Unterminated CDATA grows lexer buffer, not the tree
+        XmlParser c;
+        c.set_memory_budget(c.get_memory_used() + 4096);
+        std::istringstream start("<a><![CDATA[");
+        bool open = c.feed(start);
+        int chunks = 0;
+        while (open && chunks < 1000)
+        {
+            std::istringstream chunk(std::string(64, 'x'));
+            open = c.feed(chunk);
+            chunks++;
+        }
+        check(!open && chunks < 100 && c.is_over_budget() && \
+              c.get_error().type == MEMORY_LIMIT, "Budget inside token");
+    }
+
+    /// Error positions
+    {
+        XmlParser p;
+        feed_chunks(p, "<doc>\n  <a>text</a>\n  <b>&bogus;</b>\n</doc>", 5);
+        const ParseError &e = p.get_error();
+        check(e.type == ENTITY_ERROR, "Error type");
+        check(e.line == 3 && e.column == 12 && e.offset == 31,
+              "Error position");
+        check(e.depth == 2, "Error depth");
+
+        p.reset();
+        check(p.get_error().type == PARSE_OK && !p.top(), "Reset");
+        feed_chunks(p, "<doc>\n<a/>\n</a>", 3);
+        check(e.type == UNBALANCED_TAG && e.line == 3 && e.column == 1,
+              "Structure error position");
+    }
+
+    /// Comments, PIs and whitespace may follow top-level element
+    {
+        XmlParser p, t, e;
+        feed_chunks(p, "<a>x</a><!-- c --><?p d?> ", 5);
+        feed_chunks(t, "<a>x</a><b/>", 5);
+        feed_chunks(e, "<a>x</a>y", 5);
+        check(p.is_finished() && p.get_error().type == PARSE_OK && \
+              p.top()->get_printable() == String("<a>x</a>"), "Epilog");
+        check(t.get_error().type == MULTI_TOP && \
+              e.get_error().type == MULTI_TOP, "Content after top");
+
+        XmlParser k;
+        k.set_whitespace_mode(PRESERVE_SPACE);
+        feed_chunks(k, "<?xml version=\"1.0\"?>\n<a> x </a>\n", 4);
+        check(k.is_finished() && k.get_error().type == PARSE_OK && \
+              k.top()->get_type() == ELEMENT_NODE && \
+              k.top()->get_printable() == String("<a> x </a>"),
+              "Preserved prolog space");
+    }
+
+    /// Parser reuse
+    {
+        const char *doc = "<list><item><a x=\"1\">text</a></item>tail</list>";
+        XmlParser p;
+        p.set_whitespace_mode(NORMALIZE_SPACE);
+        feed_chunks(p, doc, 7);
+        String first = p.top()->get_printable();
+        size_t used = p.get_memory_used();
+        for (int i = 0; i < 100; i++)
+        {
+            p.reset();
+            feed_chunks(p, doc, 7);
+        }
+        check(p.top()->get_printable() == first, "Reset parser output");
+        check(p.get_memory_used() == used, "Reset keeps memory flat");
+        p.reset();
+        check(!p.top() && p.get_memory_peak() == p.get_memory_used(),
+              "Reset peak");
+    }
+
+    /// Lazy attributes
+    {
+        const char *doc = "<doc a=\"1\" b=\"x &amp; y\">"
+            "<e\nk=\"&#x41;v\" /><n/><m z=\"\"/></doc>";
+        XmlParser eager, lazy;
+        lazy.set_lazy_attributes(true);
+        feed_chunks(eager, doc, 4);
+        feed_chunks(lazy, doc, 4);
+        ElementNode *top = (ElementNode *)(lazy.top());
+        String b("b"), k("k"), none("c");
+        check(top->find_attribute(b)->get_value() == "x & y",
+              "Lazy attribute lookup");
+        check(!top->find_attribute(none) && top->get_attributes_count() == 2,
+              "Lazy attribute count");
+        ElementNode *e = (ElementNode *)(top->first_child());
+        check(e->get_attribute(0)->get_value() == "Av" && \
+              !((ElementNode *)(top->get_child(1)))->has_attributes(),
+              "Lazy empty tag");
+        check(lazy.top()->get_printable() == eager.top()->get_printable(),
+              "Lazy attributes output");
+    }
+
+    /// Lazy subtrees
+    {
+        /// Builder does not depend on set_lazy_depth()
+        ElementNode raw(String("r"));
+        raw.set_raw_children(String("<b>t</b></r>"));
+        MemoryAccount reader;
+        {
+            MemoryScope scope(&reader);
+            check(raw.get_children_count() == 1 && reader.get_used() > 0,
+                  "Lazy build account");
+        }
+
+        const char *doc = "<doc><a x=\"1\">one<b><c>two</c></b><!-- </a> -->"
+            "</a><d/><e>three</e></doc>";
+        XmlParser eager, shallow, lazy;
+        shallow.set_lazy_depth(1);
+        lazy.set_lazy_depth(2);
+        feed_chunks(eager, doc, 3);
+        feed_chunks(shallow, doc, 3);
+        feed_chunks(lazy, doc, 3);
+        check(shallow.is_finished() && lazy.is_finished(), "Lazy finished");
+        ElementNode *top = (ElementNode *)(lazy.top());
+        ElementNode *a = (ElementNode *)(top->first_child());
+        check(!top->has_raw_children() && a->has_raw_children(),
+              "Lazy levels");
+        check(a->get_children_count() == 2 && !a->has_raw_children() && \
+              ((ElementNode *)(a->get_child(1)))->has_raw_children(),
+              "Lazy level build");
+        check(lazy.top()->get_printable() == eager.top()->get_printable() && \
+              shallow.top()->get_printable() == eager.top()->get_printable(),
+              "Lazy subtrees output");
+
+        /// Lazy levels are read with settings of parser
+        const char *spaced = "<doc>\n <a>\n  <b> x <![CDATA[y]]> </b>\n"
+            " </a>\n</doc>";
+        XmlParser eager_space, lazy_space;
+        eager_space.set_whitespace_mode(PRESERVE_SPACE);
+        eager_space.set_text_coalescing(false);
+        lazy_space.set_whitespace_mode(PRESERVE_SPACE);
+        lazy_space.set_text_coalescing(false);
+        lazy_space.set_lazy_depth(1);
+        feed_chunks(eager_space, spaced, 5);
+        feed_chunks(lazy_space, spaced, 5);
+        ElementNode *ea = (ElementNode *)
+            (((ElementNode *)(eager_space.top()))->get_child(1));
+        ElementNode *la = (ElementNode *)
+            (((ElementNode *)(lazy_space.top()))->get_child(1));
+        ElementNode *eb = (ElementNode *)(ea->get_child(1));
+        ElementNode *lb = (ElementNode *)(la->get_child(1));
+        check(lazy_space.top()->get_printable() == \
+              eager_space.top()->get_printable() && \
+              lb->get_children_count() == eb->get_children_count(),
+              "Lazy preserved space");
+
+        /// Malformed lazy markup is kept instead of children
+        XmlParser broken;
+        broken.set_lazy_depth(1);
+        feed_chunks(broken, "<doc><a>&bogus;</a></doc>", 4);
+        ElementNode *ba = (ElementNode *)
+            (((ElementNode *)(broken.top()))->first_child());
+        check(broken.is_finished() && ba->get_children_count() == 0 && \
+              ba->has_raw_children(), "Lazy malformed markup");
+    }
+
+    /// Subtree sharing
+    {
+        const char *doc = "<list><p><addr><city>Oslo</city></addr></p>"
+            "<p><addr><city>Oslo</city></addr></p>"
+            "<p><addr><city>Rome</city></addr></p><p><x/></p></list>";
+        XmlParser eager, shared;
+        shared.set_subtree_sharing(true);
+        feed_chunks(eager, doc, 4);
+        feed_chunks(shared, doc, 4);
+        ElementNode *top = (ElementNode *)(shared.top());
+        check(top->get_child(0) == top->get_child(1) && \
+              top->get_child(0)->is_shared() && \
+              top->get_child(1) != top->get_child(2), "Shared subtrees");
+        check(shared.get_shared_count() == 9, "Shared count");
+        check(shared.top()->get_printable() == eager.top()->get_printable(),
+              "Shared output");
+        shared.reset();
+        check(shared.get_shared_count() == 0, "Shared reset");
+
+        /// Records taken by handlers are not interned
+        std::string many("<list>");
+        for (int i = 0; i < 2000; i++)
+            many += "<p><addr><city>C" + std::to_string(i) + \
+                "</city></addr></p><q><x/></q>";
+        many += "</list>";
+        XmlParser records;
+        Keeper k;
+        records.set_subtree_sharing(true);
+        records.add_handler("/list/p", &k);
+        records.set_memory_budget(1 << 16);
+        feed_chunks(records, many.c_str(), 64);
+        check(records.is_finished() && records.get_shared_count() == 3 && \
+              !k.kept->first_child()->is_shared(), "Sharing outside records");
+    }
+
+    /// Frozen documents
+    {
+        const char *doc = "<list><p a=\"1\"><addr><city>Oslo</city></addr></p>"
+            "<p><addr><city>Oslo</city></addr></p><p><x/></p></list>";
+        XmlParser p;
+        p.set_lazy_attributes(true);
+        p.set_lazy_depth(2);
+        p.set_subtree_sharing(true);
+        check(!p.freeze(), "Freeze unfinished");
+        size_t used = p.get_memory_used();
+        feed_chunks(p, doc, 4);
+        String expected = p.top()->get_printable();
+        Document *d = p.freeze();
+        check(d && !p.top() && p.get_memory_used() == used,
+              "Freeze resets parser");
+
+        Query *q = Query::compile("/list/p/addr/city");
+        int matched[4] = {0, 0, 0, 0};
+        std::thread readers[4];
+        for (int t = 0; t < 4; t++)
+            readers[t] = std::thread([q, &expected, &matched, t](Document *r)
+            {
+                for (int i = 0; i < 100; i++)
+                {
+                    ElementList found;
+                    q->evaluate(r->top(), found);
+                    if (found.get_length() == 2 && \
+                        r->top()->get_printable() == expected)
+                        matched[t]++;
+                }
+                r->release();
+            }, d->acquire());
+        d->release();
+        for (int t = 0; t < 4; t++)
+            readers[t].join();
+        check(matched[0] + matched[1] + matched[2] + matched[3] == 400,
+              "Concurrent readers");
+        delete q;
+    }
+
+    /// Incremental edits
+    {
+        std::string text("<cfg><a x=\"1\">one</a><b><c>two</c></b><d/></cfg>");
+        EditableDocument doc;
+        check(doc.load(text.data(), text.size()) && \
+              doc.get_ranges().get_length() == 5, "Edit load");
+        ElementNode *top = doc.top();
+        XmlNode *a = top->get_child(0), *b = top->get_child(1),
+            *d = top->get_child(2);
+        XmlNode *c = ((ElementNode *)(b))->first_child();
+
+        /// Text inside c: only c is parsed again
+        size_t at = text.find("two");
+        check(doc.replace(at, at + 3, "three", 5) && doc.top() == top && \
+              top->get_child(0) == a && top->get_child(1) == b && \
+              top->get_child(2) == d && \
+              ((ElementNode *)(b))->first_child() != c, "Edit element");
+
+        /// Sibling added after c: c is not balanced, b is parsed
+        text.assign(doc.get_text().get_data(), doc.get_text().get_length());
+        at = text.find("</c>") + 4;
+        check(doc.replace(at, at, "<e/>", 4) && top->get_child(1) != b && \
+              top->get_child(0) == a && top->get_child(2) == d,
+              "Edit parent");
+
+        text.assign(doc.get_text().get_data(), doc.get_text().get_length());
+        check(!doc.replace(0, 5, "<cfg", 4) && \
+              doc.get_text() == String(text.c_str()), "Edit malformed");
+
+        XmlParser p;
+        feed_chunks(p, text.c_str(), 64);
+        RangeList &r = doc.get_ranges();
+        check(doc.top()->get_printable() == p.top()->get_printable() && \
+              r.get_length() == 6 && r[4].element->get_name() == "e" && \
+              text.substr(r[4].begin, r[4].end - r[4].begin) == "<e/>" && \
+              r[0].end == text.size(), "Edit ranges");
+    }
+
+    /// Checkpoint at every byte, restore into a fresh parser
+    {
+        std::string doc("<?xml version=\"1.0\"?><list a=\"x&amp;y\">"
+                        "<item n=\"1\"><x/>one &lt; two</item><!--c-->"
+                        "<item><y/><![CDATA[<raw>]]></item>"
+                        "<other k=\"v\"><b/></other></list>");
+        XmlParser whole;
+        ItemCounter h;
+        whole.add_handler("/list/item", &h);
+        feed_chunks(whole, doc.c_str(), doc.size());
+        String expected = whole.top()->get_printable();
+
+        bool same = true, handled = true;
+        for (size_t k = 1; k < doc.size() && same; k++)
+        {
+            XmlParser a, b;
+            ItemCounter ha, hb;
+            a.add_handler("/list/item", &ha);
+            b.add_handler("/list/item", &hb);
+            feed_chunks(a, doc.substr(0, k).c_str(), k);
+
+            String blob;
+            same = a.save(blob) && \
+                b.restore(blob.get_data(), blob.get_length()) && \
+                b.get_offset() == k;
+            if (!same)
+                break;
+            feed_chunks(b, doc.substr(k).c_str(), doc.size());
+            same = b.is_finished() && b.get_error().type == PARSE_OK && \
+                b.top()->get_printable() == expected;
+
+            ha.names += hb.names;
+            handled = handled && ha.count + hb.count == 2 && \
+                ha.names == h.names;
+        }
+        check(same, "Checkpoint restore");
+        check(handled, "Checkpoint handlers");
+
+        XmlParser p;
+        String blob;
+        feed_chunks(p, "<a><b x=\"1", 10);
+        p.save(blob);
+        check(!p.restore(blob.get_data(), blob.get_length() - 1) && \
+              !p.top(), "Checkpoint malformed");
+    }
+
+    /// Feeding with byte and token budgets
+    {
+        std::string doc("<log>");
+        for (int i = 0; i < 50; i++)
+            doc += "<entry id=\"" + std::to_string(i) + "\">message text</entry>";
+        doc += "<long>" + std::string(1000, 'x') + "</long></log>";
+        XmlParser whole;
+        feed_chunks(whole, doc.c_str(), doc.size());
+
+        XmlParser p;
+        std::istringstream is(doc);
+        feed_status status;
+        int calls = 0;
+        bool bounded = true;
+        do
+        {
+            unsigned long before = p.get_offset();
+            status = p.feed(is, 64);
+            bounded = bounded && p.get_offset() - before <= 64;
+            calls++;
+        }
+        while (status == MORE_PENDING);
+        check(status == FEED_OK && bounded && \
+              calls == (int)((doc.size() + 63) / 64), "Byte budget");
+        check(p.is_finished() && \
+              p.top()->get_printable() == whole.top()->get_printable(),
+              "Byte budget tree");
+
+        /// Budget ending between < and the character telling markup
+        std::string marks("<?xml version=\"1.0\"?><!DOCTYPE r>"
+                          "<r>a<!-- c -->b<?p d?><![CDATA[x]]></r>");
+        XmlParser m, bytes;
+        feed_chunks(m, marks.c_str(), marks.size());
+        std::istringstream ms(marks);
+        calls = 0;
+        while ((status = bytes.feed(ms, 1)) == MORE_PENDING)
+            calls++;
+        check(status == FEED_OK && calls == (int)(marks.size()) - 1 && \
+              bytes.is_finished() && \
+              bytes.top()->get_printable() == m.top()->get_printable(),
+              "One byte budget");
+
+        XmlParser t;
+        std::istringstream ts("<a><b/>text<c></c></a>");
+        calls = 0;
+        while (t.feed(ts, 0, 2) == MORE_PENDING)
+            calls++;
+        check(calls == 2 && t.is_finished() && \
+              ((ElementNode *)(t.top()))->get_children_count() == 3,
+              "Token budget");
+
+        XmlParser e;
+        std::istringstream es("<a><b></a>");
+        check(e.feed(es, 8) == MORE_PENDING && e.feed(es, 8) == FEED_ERROR,
+              "Budget error");
+    }
+
+    /// Streams driven by epoll
+    {
+        ParserPool pool;
+        StreamDriver driver(&pool);
+        StreamRecorder r[3];
+        int pipes[3][2];
+        bool added = driver.is_open();
+        for (int i = 0; i < 3; i++)
+            added = added && pipe(pipes[i]) == 0 && \
+                driver.add_stream(pipes[i][0], &r[i]);
+        check(added && driver.get_stream_count() == 3 && \
+              !driver.add_stream(pipes[0][0], &r[0]), "Driver add");
+
+        /// Parts of documents come to all pipes in turn
+        const char *parts[] = {"<msg><a x=\"1", "\"/>te", "xt</m", "sg>"};
+        for (int k = 0; k < 4; k++)
+        {
+            for (int i = 0; i < 3; i++)
+                if (i != 2 || k < 2)
+                    write(pipes[i][1], parts[k], strlen(parts[k]));
+            driver.poll(100);
+        }
+        close(pipes[0][1]);
+        close(pipes[1][1]);
+        write(pipes[2][1], "</wrong>", 8);
+        close(pipes[2][1]);
+        while (driver.get_stream_count() > 0 && driver.poll(100) > 0)
+            ;
+        check(r[0].documents == 1 && r[1].documents == 1 && \
+              r[1].last == String("<msg><a x=\"1\"></a>text</msg>") && \
+              r[0].ended && \
+              r[0].error == PARSE_OK, "Driver pipes");
+        check(r[2].ended && r[2].documents == 0 && \
+              r[2].error == UNBALANCED_TAG && \
+              driver.get_stream_count() == 0, "Driver error");
+
+        /// Budget splits a large write between polls
+        int pair[2];
+        StreamRecorder big;
+        std::string doc("<log>");
+        for (int i = 0; i < 40; i++)
+            doc += "<entry>message text</entry>";
+        doc += "</log>";
+        driver.set_feed_budget(64);
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        driver.add_stream(pair[0], &big);
+        write(pair[1], doc.data(), doc.size());
+        close(pair[1]);
+        while (driver.get_stream_count() > 0 && driver.poll(100) > 0)
+            ;
+        check(big.ended && big.documents == 1 && big.error == PARSE_OK && \
+              big.feeds >= (int)(doc.size() / 64), "Driver budget");
+        check(pool.get_idle_count() == 3, "Driver parsers");
+
+        /// Reads ending between < and !
+        StreamRecorder split;
+        const char *pieces[] = {"<r><", "!-- c -->a<", "![CDATA[x]]></r>"};
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        driver.add_stream(pair[0], &split);
+        for (int k = 0; k < 3; k++)
+        {
+            write(pair[1], pieces[k], strlen(pieces[k]));
+            driver.poll(100);
+        }
+        close(pair[1]);
+        while (driver.get_stream_count() > 0 && driver.poll(100) > 0)
+            ;
+        check(split.ended && split.error == PARSE_OK && \
+              split.last == String("<r>ax</r>"), "Driver split markup");
+
+        /// Several documents, some with trailing newlines, in one write
+        const char *docs[] = {"<a/>\n", "<a/><b/>", "<a></a>\n<b></b>\n",
+                              "<x>1</x>\n\n<y/> <z>3</z>\n"};
+        int counts[] = {1, 2, 2, 3};
+        const char *lasts[] = {"<a></a>", "<b></b>", "<b></b>", "<z>3</z>"};
+        bool separated = true;
+        for (int budget = 0; budget < 8; budget += 5)
+        {
+            driver.set_feed_budget(budget);
+            for (int k = 0; k < 4; k++)
+            {
+                StreamRecorder many;
+                socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+                driver.add_stream(pair[0], &many);
+                write(pair[1], docs[k], strlen(docs[k]));
+                close(pair[1]);
+                while (driver.get_stream_count() > 0 && driver.poll(100) > 0)
+                    ;
+                separated = separated && many.ended && \
+                    many.error == PARSE_OK && many.documents == counts[k] && \
+                    many.last == String(lasts[k]);
+            }
+        }
+        check(separated, "Driver documents");
+    }
+
+    /// Parser pool
+    {
+        ParserPool pool(0, 2);
+        XmlParser *a = pool.acquire(), *b = pool.acquire(),
+            *c = pool.acquire();
+        pool.release(a);
+        pool.release(b);
+        pool.release(c);
+        check(pool.get_idle_count() == 2, "Pool idle limit");
+        a = pool.acquire();
+        check(a == b, "Pool reuse");
+        pool.release(a);
+
+        ListFactory factory;
+        ParserPool shared(&factory);
+        int parsed[4] = {0, 0, 0, 0};
+        std::thread workers[4];
+        for (int t = 0; t < 4; t++)
+            workers[t] = std::thread([&shared, &parsed, t]()
+            {
+                for (int i = 0; i < 200; i++)
+                {
+                    XmlParser *p = shared.acquire();
+                    std::istringstream is("<list><item/><other/></list>");
+                    if (p->feed(is) && p->is_finished())
+                        parsed[t]++;
+                    shared.release(p);
+                }
+            });
+        for (int t = 0; t < 4; t++)
+            workers[t].join();
+        check(parsed[0] + parsed[1] + parsed[2] + parsed[3] == 800,
+              "Pool threads");
+        check(shared.get_idle_count() <= 4, "Pool size");
+    }
+
+#ifdef QWE_STATS
+    /// Statistics
+    {
+        XmlParser p;
+        feed_chunks(p, "<a x=\"12\"><b/>text<!--c--></a>", 6);
+        ParserStats &s = p.get_stats();
+        check(s.tokens[TAG] == 3, "Tag count");
+        check(s.tokens[COMMENT] == 1, "Comment count");
+        check(s.bytes[TEXT] == 4, "Text bytes");
+        check(s.max_depth == 2, "Max depth");
+        check(s.text_lengths[3] == 1, "Text histogram");
+        check(s.allocations > 0, "Allocations");
+    }
+#endif
+
+    return failed;
+}
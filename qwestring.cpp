@@ -1,52 +1,158 @@
+#include <string.h>
+#include <stdlib.h>
+#include <new>
 #include "qwestring.hpp"
 
 namespace qwe {
     LString::LString(void)
+        :chars(0), length(0), capacity(0)
+    {}
+
+    LString::LString(const char *c)
+        :chars(0), length(0), capacity(0)
     {
-        chars = new CharList();
+        append(c);
     }
 
-    LString::LString(const char *c)
+    LString::LString(const LString &s)
+        :chars(0), length(0), capacity(0)
     {
-        chars = new CharList();
-        while (*c != 0)
-            chars->push_item(*c++);
+        append(s.chars, s.length);
     }
 
-    LString::LString(LString &s)
+    LString::LString(LString &&s)
+        :chars(s.chars), length(s.length), capacity(s.capacity)
     {
-        chars = new CharList(*s.chars);
+        s.chars = 0;
+        s.length = s.capacity = 0;
     }
 
     LString::~LString(void)
     {
-        delete chars;
+        release_memory(capacity);
+        free(chars);
+    }
+
+    /**
+     * Replace string contents with a copy of another string, reusing
+     * already allocated buffer.
+     */
+    LString& LString::operator =(const LString &s)
+    {
+        if (this != &s)
+        {
+            length = 0;
+            append(s.chars, s.length);
+        }
+        return *this;
+    }
+
+    LString& LString::operator =(LString &&s)
+    {
+        if (this != &s)
+        {
+            clear();
+            chars = s.chars;
+            length = s.length;
+            capacity = s.capacity;
+            s.chars = 0;
+            s.length = s.capacity = 0;
+        }
+        return *this;
+    }
+
+    LString& LString::operator =(const char *c)
+    {
+        length = 0;
+        append(c);
+        return *this;
+    }
+
+    /**
+     * Buffer capacity is doubled, so appending characters one by
+     * one takes amortized constant time.
+     */
+    void LString::grow(size_t n)
+    {
+        if (length + n <= capacity)
+            return;
+
+        size_t c = capacity ? capacity * 2 : 16;
+        while (c < length + n)
+            c *= 2;
+        /// Buffer is kept if it cannot grow, and failure is reported
+        /// like that of operator new
+        char *grown = (char *)(realloc(chars, c));
+        if (!grown)
+            throw std::bad_alloc();
+        chars = grown;
+        charge_memory(c - capacity);
+        capacity = c;
+        QWE_STAT(count_alloc(c));
     }
 
     void LString::append(const char *c)
     {
-        while (*c != 0)
-            chars->push_item(*c++);
+        append(c, strlen(c));
     }
 
     void LString::append(char c)
     {
-        chars->push_item(c);
+        grow(1);
+        chars[length++] = c;
     }
 
-    void LString::send(std::ostream &o)
+    void LString::append(const char *c, size_t n)
     {
-        CharList::StlIterator i, end;
-        i = chars->begin();
-        end = chars->end();
-        while (i != end)
+        if (n == 0)
+            return;
+        /// Source may point into our own buffer which grow() moves
+        if (c >= chars && c < chars + length)
         {
-            o.put(*i);
-            i++;
+            size_t offset = c - chars;
+            grow(n);
+            c = chars + offset;
         }
+        else
+            grow(n);
+        memcpy(chars + length, c, n);
+        length += n;
     }
 
-    std::ostream& operator <<(std::ostream &o, LString &s)
+    void LString::clear(void)
+    {
+        release_memory(capacity);
+        free(chars);
+        chars = 0;
+        length = capacity = 0;
+    }
+
+    size_t LString::get_capacity(void)
+    {
+        return capacity;
+    }
+
+    bool LString::is_empty(void)
+    {
+        return (length == 0);
+    }
+
+    size_t LString::get_length(void)
+    {
+        return length;
+    }
+
+    const char* LString::get_data(void)
+    {
+        return chars;
+    }
+
+    void LString::send(std::ostream &o) const
+    {
+        o.write(chars, length);
+    }
+
+    std::ostream& operator <<(std::ostream &o, const LString &s)
     {
         s.send(o);
         return o;
@@ -64,36 +170,15 @@ namespace qwe {
         return s;
     }
 
-    LString& operator +=(LString &s1, LString &s2)
+    LString& operator +=(LString &s1, const LString &s2)
     {
-        CharList::StlIterator i = s2.chars->begin(), end = s2.chars->end();
-        while (i != end)
-        {
-            s1.append(*i);
-            i++;
-        }
+        s1.append(s2.chars, s2.length);
         return s1;
     }
 
-    bool operator ==(LString &s1, LString &s2)
+    bool operator ==(const LString &s1, const LString &s2)
     {
-        CharList::StlIterator i1, i2, end1, end2;
-        i1 = s1.chars->begin();
-        end1 = s1.chars->end();
-        i2 = s2.chars->begin();
-        end2 = s2.chars->end();
-
-        if (s1.chars->get_length() == s2.chars->get_length())
-        {
-            while (i1 != end1)
-            {
-                if (*i1 != *i2)
-                    return false;
-                i1++, i2++;
-            }
-            return true;
-        }
-        else
-            return false;
+        return (s1.length == s2.length && \
+                (s1.length == 0 || !memcmp(s1.chars, s2.chars, s1.length)));
     }
 }
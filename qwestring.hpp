@@ -3,29 +3,64 @@
 #include <iostream>
 #include "qwelist.hpp"
 
+#include <stddef.h>
+
 /**
  * String.
  */
 
 namespace qwe {
-    typedef List <char> CharList;
-
+    /**
+     * String with contiguous character storage.
+     *
+     * Characters are kept in a single growable buffer, so blocks of
+     * character data may be appended at once.
+     */
     class LString {
     private:
         /**
-         * Characters.
+         * Characters, not terminated with zero.
+         */
+        char *chars;
+
+        size_t length;
+
+        /**
+         * Size of allocated buffer.
+         */
+        size_t capacity;
+
+        /**
+         * Make room for at least @a n more characters.
          */
-        CharList *chars;
+        void grow(size_t n);
 
     public:
         LString(void);
 
         LString(const char *c);
 
-        LString(LString &s);
+        LString(const LString &s);
+
+        /**
+         * Takes over buffer of @a s, leaving it empty.
+         */
+        LString(LString &&s);
 
         ~LString(void);
 
+        LString& operator =(const LString &s);
+
+        /**
+         * Frees own buffer and takes over buffer of @a s.
+         */
+        LString& operator =(LString &&s);
+
+        /**
+         * Replaces contents keeping allocated buffer.
+         */
+        LString& operator =(const char *c);
+
         /**
          * Appends character contents to string.
          */
@@ -33,16 +68,41 @@ namespace qwe {
 
         void append(char c);
 
+        /**
+         * Appends block of @a n characters to string.
+         */
+        void append(const char *c, size_t n);
+
+        /**
+         * Empties string and frees its buffer.
+         */
+        void clear(void);
+
+        bool is_empty(void);
+
+        size_t get_length(void);
+
+        /**
+         * Size of allocated buffer, as charged to memory account.
+         */
+        size_t get_capacity(void);
+
+        /**
+         * Returns pointer to string characters. Characters are not
+         * terminated with zero.
+         */
+        const char* get_data(void);
+
         /**
          * Sends string to output stream.
          */
-        void send(std::ostream &o);
+        void send(std::ostream &o) const;
 
-        friend LString& operator +=(LString &s1, LString &s2);
-        friend bool operator ==(LString &s1, LString &s2);
+        friend LString& operator +=(LString &s1, const LString &s2);
+        friend bool operator ==(const LString &s1, const LString &s2);
     };
 
-    std::ostream& operator <<(std::ostream &o, LString &s);
+    std::ostream& operator <<(std::ostream &o, const LString &s);
     LString& operator +=(LString &s, const char *c);
     LString& operator +=(LString &s, char c);
 
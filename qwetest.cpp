@@ -1,27 +1,42 @@
 #include <stdio.h>
 #include <iostream>
 #include <algorithm>
+#include <utility>
 #include "qwexml.hpp"
 
 using namespace qwe;
 
-int main()
+struct Span {
+    int begin;
+    int end;
+};
+
+/**
+ * Elements own their children, so every parent gets its own copy of
+ * the tag unless it is shared with XmlNode::share().
+ */
+ElementNode* make_tag(void)
 {
-    /// Building tree from C++
-    ElementNode *root1 = new ElementNode("root");
-    ElementNode *root2 = new ElementNode("root2");
     ElementNode *tag = new ElementNode("tag");
     TextNode *text = new TextNode("my text");
 
     tag->add_child(text);
     tag->add_attribute("key", "value");
+    return tag;
+}
+
+int main()
+{
+    /// Building tree from C++
+    ElementNode *root1 = new ElementNode("root");
+    ElementNode *root2 = new ElementNode("root2");
 
-    std::string s[4] = {"foo", "bar", "baz", "quux"};
+    const char *s[4] = {"foo", "bar", "baz", "quux"};
     for (int i = 0; i < 4; i++)
     {
-        root1->add_child(tag);
+        root1->add_child(make_tag());
         ((ElementNode *)(root1->last_child()))->first_attribute()->set_value(s[i]);
-        root2->add_child(tag);
+        root2->add_child(make_tag());
     }
 
     std::cout << "Root:" << std::endl;
@@ -43,5 +58,81 @@ int main()
         std::cout << "std::equal test #1 passed" << std::endl;
     if (!std::equal(root1->children_begin(), root1->children_end(), root2->children_begin()))
         std::cout << "std::equal test #2 passed" << std::endl;
+
+
+    /// Moving strings, lists and node contents does not copy
+    /// characters
+    String contents("text moved from buffer to buffer");
+    const char *data = contents.get_data();
+    String moved(std::move(contents));
+    TextNode *node = new TextNode(std::move(moved));
+    if (node->get_contents().get_data() == data && contents.is_empty() && \
+        moved.is_empty())
+        std::cout << "move test #1 passed" << std::endl;
+
+    NodeList list;
+    list.push_item(node);
+    NodeList other(std::move(list));
+    if (other.get_length() == 1 && other.first_item() == node)
+        std::cout << "move test #2 passed" << std::endl;
+    delete node;
+
+    /// Random access to children
+    NodeList::StlIterator b = root1->children_begin();
+    if (root1->children_end() - b == 4 && b[3] == root1->get_child(3) && \
+        root1->get_child(3) == root1->last_child() && \
+        std::find(b, root1->children_end(), root1->get_child(2)) == b + 2)
+        std::cout << "random access test passed" << std::endl;
+
+    NodeList::StlIterator i = b, j = i++;
+    if (j == b && i == b + 1 && i-- == b + 1 && i == b && \
+        2 + b == b + 2 && std::prev(root1->children_end()) == b + 3)
+        std::cout << "iterator arithmetic test passed" << std::endl;
+
+    SmallVector <Span, 2> spans;
+    Span span = {1, 2};
+    spans.push_item(span);
+    if (spans.begin()->end == 2)
+        std::cout << "iterator member access test passed" << std::endl;
+
+    /// Attributes beyond inline storage
+    const char *keys[5] = {"a", "b", "c", "d", "e"};
+    for (int i = 0; i < 5; i++)
+        root1->add_attribute(keys[i], s[i % 4]);
+    String e("e");
+    if (root1->find_attribute(e) && \
+        root1->find_attribute(e)->get_value() == String("foo"))
+        std::cout << "attribute storage test passed" << std::endl;
+
+    /// Sharing subtree between parents
+    ElementNode *shared = make_tag();
+    root1->add_child(shared);
+    root2->add_child((ElementNode *)(shared->share()));
+    if (shared->is_shared() && shared->get_parent() == root1 && \
+        root2->last_child() == shared)
+        std::cout << "sharing test passed" << std::endl;
+
+    ElementNode *copy = make_tag();
+    if (copy->equals(shared) && copy->get_hash() == shared->get_hash() && \
+        !copy->equals(root1->first_child()))
+        std::cout << "structural equality test passed" << std::endl;
+    delete copy;
+
+    ElementNode *grown = make_tag(), *twin = make_tag();
+    unsigned long before = grown->get_hash();
+    ((TextNode *)(grown->first_child()))->set_contents("other text");
+    ((TextNode *)(twin->first_child()))->set_contents("other text");
+    grown->add_child(make_tag());
+    twin->add_child(make_tag());
+    if (grown->get_hash() != before && \
+        grown->get_hash() == twin->get_hash() && grown->equals(twin))
+        std::cout << "hash reset test passed" << std::endl;
+    delete grown;
+    delete twin;
+
+    delete root1;
+    if (!shared->is_shared() && !shared->get_parent())
+        std::cout << "shared release test passed" << std::endl;
+    delete root2;
     return 0;
 }
@@ -0,0 +1,356 @@
+#ifndef QWE_VECTOR_H
+#define QWE_VECTOR_H
+#ifdef QWE_USE_STL
+#include <iterator>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include "qwestats.hpp"
+#include "qwememory.hpp"
+
+namespace qwe {
+    /**
+     * Array with inline storage for a few items.
+     *
+     * First @a N items are stored inside the object itself, so small
+     * vectors need no allocations at all. When more items are
+     * pushed, they are moved to a contiguous heap buffer which is
+     * doubled as needed.
+     *
+     * Interface follows List, so both may be used with the same
+     * code. In addition items may be accessed by index in constant
+     * time and iterators are random-access.
+     *
+     * @param T Type of items. Items are moved with memcpy(), so it
+     * must be trivially copyable (like pointers).
+     *
+     * @param N Number of items stored inline, may be 0.
+     *
+     * @see Vector
+     */
+    template <class T, int N>
+    class SmallVector {
+    private:
+        typedef T Data;
+
+        /**
+         * Either SmallVector::inline_items or heap buffer.
+         */
+        Data *items;
+
+        int length;
+
+        int capacity;
+
+        Data inline_items[N ? N : 1];
+
+        /**
+         * Make room for one more item.
+         */
+        void _grow(void)
+        {
+            int c = capacity ? capacity * 2 : 4;
+            Data *heap = (Data *)(malloc(c * sizeof(Data)));
+            /// Failure is reported like that of operator new, leaving
+            /// items in place
+            if (!heap)
+                throw std::bad_alloc();
+            memcpy(heap, items, length * sizeof(Data));
+            QWE_STAT(count_alloc(c * sizeof(Data)));
+            charge_memory(c * sizeof(Data));
+            _free_heap();
+            items = heap;
+            capacity = c;
+        }
+
+        void _free_heap(void)
+        {
+            if (items != inline_items)
+            {
+                free(items);
+                release_memory(capacity * sizeof(Data));
+            }
+        }
+
+        SmallVector(const SmallVector &v);
+        SmallVector& operator =(const SmallVector &v);
+    public:
+        /**
+         * STL-style random-access iterator for SmallVector.
+         *
+         * Iterator keeps item index instead of pointer, so rend() may
+         * point before the first item like with List.
+         */
+        class StlIterator {
+        private:
+            SmallVector<T, N> *vector;
+
+            int position;
+
+        public:
+    #ifdef QWE_USE_STL
+            /**
+             * Standard traits.
+             */
+            typedef std::random_access_iterator_tag iterator_category;
+            typedef Data value_type;
+            typedef ptrdiff_t difference_type;
+            typedef Data* pointer;
+            typedef Data& reference;
+    #endif
+
+            StlIterator(void)
+                :vector(0), position(0)
+            {}
+
+            StlIterator(SmallVector<T, N> *v, int p)
+                :vector(v), position(p)
+            {}
+
+            StlIterator& operator ++(void)
+            {
+                position++;
+                return *this;
+            }
+
+            StlIterator operator ++(int)
+            {
+                StlIterator old(*this);
+                position++;
+                return old;
+            }
+
+            StlIterator& operator --(void)
+            {
+                position--;
+                return *this;
+            }
+
+            StlIterator operator --(int)
+            {
+                StlIterator old(*this);
+                position--;
+                return old;
+            }
+
+            StlIterator& operator +=(ptrdiff_t n)
+            {
+                position += n;
+                return *this;
+            }
+
+            StlIterator& operator -=(ptrdiff_t n)
+            {
+                position -= n;
+                return *this;
+            }
+
+            StlIterator operator +(ptrdiff_t n) const
+            {
+                return StlIterator(vector, position + n);
+            }
+
+            friend StlIterator operator +(ptrdiff_t n, StlIterator iter)
+            {
+                return iter + n;
+            }
+
+            StlIterator operator -(ptrdiff_t n) const
+            {
+                return StlIterator(vector, position - n);
+            }
+
+            ptrdiff_t operator -(StlIterator iter) const
+            {
+                return position - iter.position;
+            }
+
+            bool operator==(StlIterator iter) const
+            {
+                return (vector == iter.vector && position == iter.position);
+            }
+
+            bool operator !=(StlIterator iter) const
+            {
+                return (vector != iter.vector || position != iter.position);
+            }
+
+            bool operator <(StlIterator iter) const
+            {
+                return position < iter.position;
+            }
+
+            bool operator >(StlIterator iter) const
+            {
+                return position > iter.position;
+            }
+
+            bool operator <=(StlIterator iter) const
+            {
+                return position <= iter.position;
+            }
+
+            bool operator >=(StlIterator iter) const
+            {
+                return position >= iter.position;
+            }
+
+            Data& operator *(void) const
+            {
+                return vector->items[position];
+            }
+
+            Data* operator ->(void) const
+            {
+                return &vector->items[position];
+            }
+
+            Data& operator [](ptrdiff_t n) const
+            {
+                return vector->items[position + n];
+            }
+        };
+
+        SmallVector(void)
+            :items(inline_items), length(0), capacity(N)
+        {}
+
+        /**
+         * Takes over heap buffer of @a v or copies its inline items.
+         */
+        SmallVector(SmallVector &&v)
+            :items(inline_items), length(0), capacity(N)
+        {
+            *this = std::move(v);
+        }
+
+        ~SmallVector(void)
+        {
+            _free_heap();
+        }
+
+        SmallVector& operator =(SmallVector &&v)
+        {
+            if (this != &v)
+            {
+                _free_heap();
+                if (v.items == v.inline_items)
+                {
+                    memcpy(inline_items, v.inline_items, v.length * sizeof(Data));
+                    items = inline_items;
+                    capacity = N;
+                }
+                else
+                {
+                    items = v.items;
+                    capacity = v.capacity;
+                    v.items = v.inline_items;
+                    v.capacity = N;
+                }
+                length = v.length;
+                v.length = 0;
+            }
+            return *this;
+        }
+
+        /**
+         * Bytes of heap buffer, 0 if items are stored inline.
+         */
+        size_t get_memory_size(void)
+        {
+            return (items != inline_items) ? capacity * sizeof(Data) : 0;
+        }
+
+        /**
+         * Append new item to the end of vector.
+         */
+        void push_item(Data d)
+        {
+            if (length == capacity)
+                _grow();
+            items[length++] = d;
+        }
+
+        /**
+         * Remove last item from vector.
+         *
+         * Allocated buffer is kept.
+         */
+        void pop_item(void)
+        {
+            length--;
+        }
+
+        bool is_empty(void)
+        {
+            return (length == 0);
+        }
+
+        /**
+         * Remove all items from vector, keeping allocated buffer.
+         */
+        void clear(void)
+        {
+            length = 0;
+        }
+
+        int get_length(void)
+        {
+            return length;
+        }
+
+        /**
+         * Item with index @a i, which must be less than length.
+         */
+        Data& operator [](int i)
+        {
+            return items[i];
+        }
+
+        StlIterator begin(void)
+        {
+            return StlIterator(this, 0);
+        }
+
+        StlIterator rbegin(void)
+        {
+            return StlIterator(this, length - 1);
+        }
+
+        StlIterator end(void)
+        {
+            return StlIterator(this, length);
+        }
+
+        StlIterator rend(void)
+        {
+            return StlIterator(this, -1);
+        }
+
+        /**
+         * Like with List, empty vector gives default value (0 for
+         * pointers).
+         */
+        Data first_item(void)
+        {
+            return length ? items[0] : Data();
+        }
+
+        Data last_item(void)
+        {
+            return length ? items[length - 1] : Data();
+        }
+    };
+
+    /**
+     * Contiguous growable array without inline storage.
+     */
+    template <class T>
+    class Vector : public SmallVector<T, 0> {
+    };
+}
+#endif
@@ -1,9 +1,227 @@
+#include <ctype.h>
+#include <string.h>
+#include <stdint.h>
+#include <utility>
 #include "qwexml.hpp"
 
 namespace qwe {
+    /**
+     * Returns word with high bit set in every byte of @a x which is
+     * equal to @a c.
+     */
+    static inline uint64_t bytes_equal(uint64_t x, unsigned char c)
+    {
+        const uint64_t ones = 0x0101010101010101ULL;
+        uint64_t y = x ^ (ones * c);
+        return (y - ones) & ~y & (ones * 0x80);
+    }
+
+    /**
+     * Input is scanned eight bytes at a time: each word is tested
+     * for all special characters at once, and only the word which
+     * contains one is examined byte by byte.
+     */
+    void escape(const char *s, size_t n, bool attribute, String &out)
+    {
+        const char *end = s + n, *run = s, *p = s;
+
+        while (p < end)
+        {
+            /// Skip words without special characters
+            while (p + 8 <= end)
+            {
+                uint64_t w;
+                memcpy(&w, p, 8);
+                uint64_t m = bytes_equal(w, '<') | bytes_equal(w, '&') | \
+                    bytes_equal(w, '>');
+                if (attribute)
+                    m |= bytes_equal(w, '"');
+                if (m)
+                    break;
+                p += 8;
+            }
+
+            const char *stop = (p + 8 <= end) ? p + 8 : end;
+            for (; p < stop; p++)
+            {
+                const char *entity;
+                switch (*p)
+                {
+                case '<':
+                    entity = "&lt;";
+                    break;
+                case '&':
+                    entity = "&amp;";
+                    break;
+                case '>':
+                    entity = "&gt;";
+                    break;
+                case '"':
+                    if (!attribute)
+                        continue;
+                    entity = "&quot;";
+                    break;
+                default:
+                    continue;
+                }
+                out.append(run, p - run);
+                out.append(entity);
+                run = p + 1;
+            }
+        }
+        out.append(run, end - run);
+    }
+
+    EntityDecoder::EntityDecoder(void)
+    {
+        flush();
+    }
+
+    void EntityDecoder::flush(void)
+    {
+        active = false;
+        length = 0;
+    }
+
+    bool EntityDecoder::is_active(void)
+    {
+        return active;
+    }
+
+    void EntityDecoder::start(void)
+    {
+        active = true;
+        length = 0;
+    }
+
+    bool EntityDecoder::feed(char c, String &out)
+    {
+        if (c == ';')
+        {
+            active = false;
+            return decode(out);
+        }
+        if (length == MAX_NAME || !(isalnum(c) || (c == '#' && length == 0)))
+            return false;
+        name[length++] = c;
+        return true;
+    }
+
+    void EntityDecoder::save(CheckpointWriter &w)
+    {
+        w.put_number(active);
+        w.put_chars(name, length);
+    }
+
+    void EntityDecoder::restore(CheckpointReader &r)
+    {
+        active = r.get_flag();
+        length = r.get_chars(name, MAX_NAME);
+    }
+
+    /**
+     * @see http://www.w3.org/TR/REC-xml/#sec-references
+     */
+    bool EntityDecoder::decode(String &out)
+    {
+        static const struct {
+            const char *name;
+            char c;
+        } predefined[] = {{"amp", '&'}, {"lt", '<'}, {"gt", '>'},
+                          {"quot", '"'}, {"apos", '\''}};
+
+        if (length == 0)
+            return false;
+
+        if (name[0] != '#')
+        {
+            for (size_t i = 0; i < sizeof(predefined) / sizeof(predefined[0]); i++)
+            {
+                if (!strncmp(predefined[i].name, name, length) && \
+                    predefined[i].name[length] == 0)
+                {
+                    out.append(predefined[i].c);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// Character reference
+        unsigned long code = 0;
+        int base = 10, i = 1;
+        if (length > 1 && name[1] == 'x')
+        {
+            base = 16;
+            i = 2;
+        }
+        if (i == length)
+            return false;
+        for (; i < length; i++)
+        {
+            int d;
+            if (isdigit(name[i]))
+                d = name[i] - '0';
+            else if (base == 16 && isxdigit(name[i]))
+                d = tolower(name[i]) - 'a' + 10;
+            else
+                return false;
+            code = code * base + d;
+        }
+        if (code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+            return false;
+
+        /// Encode in UTF-8
+        if (code < 0x80)
+            out.append((char)(code));
+        else if (code < 0x800)
+        {
+            out.append((char)(0xC0 | (code >> 6)));
+            out.append((char)(0x80 | (code & 0x3F)));
+        }
+        else if (code < 0x10000)
+        {
+            out.append((char)(0xE0 | (code >> 12)));
+            out.append((char)(0x80 | ((code >> 6) & 0x3F)));
+            out.append((char)(0x80 | (code & 0x3F)));
+        }
+        else
+        {
+            out.append((char)(0xF0 | (code >> 18)));
+            out.append((char)(0x80 | ((code >> 12) & 0x3F)));
+            out.append((char)(0x80 | ((code >> 6) & 0x3F)));
+            out.append((char)(0x80 | (code & 0x3F)));
+        }
+        return true;
+    }
+
+    /**
+     * 64-bit FNV-1a, continuing from hash @a h.
+     */
+    static unsigned long hash_bytes(const char *s, size_t n, unsigned long h)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            h ^= (unsigned char)(s[i]);
+            h *= 1099511628211UL;
+        }
+        return h;
+    }
+
+    static const unsigned long HASH_SEED = 14695981039346656037UL;
+
+    static unsigned long hash_string(String &s, unsigned long h)
+    {
+        /// Length is mixed in so that adjacent strings do not run
+        /// together
+        h = hash_bytes(s.get_data(), s.get_length(), h);
+        return (h ^ s.get_length()) * 1099511628211UL;
+    }
+
     XmlNode::XmlNode(void)
     {
         parent = 0;
+        references = 1;
     }
 
     XmlNode::~XmlNode(void)
@@ -14,28 +232,114 @@ namespace qwe {
         return parent;
     }
 
-    TextNode::TextNode(String &s)
+    XmlNode* XmlNode::share(void)
+    {
+        references++;
+        return this;
+    }
+
+    bool XmlNode::is_shared(void)
+    {
+        return references > 1;
+    }
+
+    void XmlNode::release(void)
+    {
+        if (--references == 0)
+            delete this;
+    }
+
+    String XmlNode::get_printable(void)
+    {
+        String s;
+        print(s);
+        return s;
+    }
+
+    TextNode::TextNode(const String &s)
         :str(s)
-    {}
+    {
+        charge_memory(sizeof(TextNode));
+    }
 
-    String TextNode::get_contents(void)
+    TextNode::TextNode(String &&s)
+        :str(std::move(s))
+    {
+        charge_memory(sizeof(TextNode));
+    }
+
+    TextNode::~TextNode(void)
+    {
+        release_memory(sizeof(TextNode));
+    }
+
+    String& TextNode::get_contents(void)
     {
         return str;
     }
 
-    void TextNode::set_contents(String &s)
+    void TextNode::set_contents(const String &s)
     {
+        if (parent)
+            ((ElementNode *)(parent))->_reset_hash();
         str = s;
     }
 
-    String& TextNode::get_printable(void)
+    void TextNode::set_contents(String &&s)
     {
-        return str;
+        if (parent)
+            ((ElementNode *)(parent))->_reset_hash();
+        str = std::move(s);
+    }
+
+    void TextNode::append_contents(const String &s)
+    {
+        if (parent)
+            ((ElementNode *)(parent))->_reset_hash();
+        str += s;
+    }
+
+    unsigned long TextNode::get_hash(void)
+    {
+        return hash_string(str, HASH_SEED ^ TEXT_NODE);
+    }
+
+    bool TextNode::equals(XmlNode *n)
+    {
+        return n->get_type() == TEXT_NODE && ((TextNode *)(n))->str == str;
+    }
+
+    node_type TextNode::get_type(void)
+    {
+        return TEXT_NODE;
+    }
+
+    size_t TextNode::get_memory_size(void)
+    {
+        return sizeof(TextNode) + str.get_capacity();
     }
 
-    AttrNode::AttrNode(String &n, String &v)
+    void TextNode::print(String &out)
+    {
+        escape(str.get_data(), str.get_length(), false, out);
+    }
+
+    AttrNode::AttrNode(const String &n, const String &v)
         :name(n), value(v)
-    {}
+    {
+        charge_memory(sizeof(AttrNode));
+    }
+
+    AttrNode::AttrNode(String &&n, String &&v)
+        :name(std::move(n)), value(std::move(v))
+    {
+        charge_memory(sizeof(AttrNode));
+    }
+
+    AttrNode::~AttrNode(void)
+    {
+        release_memory(sizeof(AttrNode));
+    }
 
     String& AttrNode::get_name(void)
     {
@@ -47,60 +351,225 @@ namespace qwe {
         return value;
     }
 
-    void AttrNode::set_value(String &v)
+    void AttrNode::set_value(const String &v)
     {
         value = v;
     }
 
     ElementNode::ElementNode(void)
+        :raw_flags(0), hash(0)
     {
-        children = new NodeList();
-        attributes = new AttrList();
+        charge_memory(sizeof(ElementNode));
     }
 
-    ElementNode::ElementNode(String &s)
-        :name(s)
+    ElementNode::ElementNode(const String &s)
+        :raw_flags(0), name(s), hash(0)
     {
-        children = new NodeList();
-        attributes = new AttrList();
+        charge_memory(sizeof(ElementNode));
+    }
+
+    ElementNode::ElementNode(String &&s)
+        :raw_flags(0), name(std::move(s)), hash(0)
+    {
+        charge_memory(sizeof(ElementNode));
     }
 
     ElementNode::~ElementNode(void)
     {
-        delete children;
-        delete attributes;
+        /// Shared children may outlive this element
+        NodeList::StlIterator i = children.begin(), e = children.end();
+        while (i != e)
+        {
+            if ((*i)->parent == this)
+                (*i)->parent = 0;
+            (*i)->release();
+            i++;
+        }
+        AttrList::StlIterator ai = attributes.begin(), ae = attributes.end();
+        while (ai != ae)
+        {
+            delete *ai;
+            ai++;
+        }
+        release_memory(sizeof(ElementNode));
+    }
+
+    void ElementNode::add_attribute(const String &name, const String &value)
+    {
+        _reset_hash();
+        _load_attributes();
+        attributes.push_item(new AttrNode(name, value));
+        QWE_STAT(count_alloc(sizeof(AttrNode)));
     }
 
-    void ElementNode::add_attribute(String &name, String &value)
+    void ElementNode::add_attribute(String &&name, String &&value)
     {
-        attributes->push_item(new AttrNode(name, value));
+        _reset_hash();
+        _load_attributes();
+        attributes.push_item(new AttrNode(std::move(name), std::move(value)));
+        QWE_STAT(count_alloc(sizeof(AttrNode)));
     }
 
     void ElementNode::add_attribute(AttrNode *n)
     {
-        attributes->push_item(n);
+        _reset_hash();
+        _load_attributes();
+        attributes.push_item(n);
     }
 
+    /**
+     * Shared node keeps its first parent.
+     */
     void ElementNode::add_child(ElementNode *n)
     {
-        children->push_item(n);
-        ((ElementNode *)(last_child()))->parent = this;
+        _reset_hash();
+        _load_children();
+        children.push_item(n);
+        if (!n->parent)
+            n->parent = this;
     }
 
     void ElementNode::add_child(TextNode *n)
     {
-        children->push_item(n);
-        ((TextNode *)(last_child()))->parent = this;
+        _reset_hash();
+        _load_children();
+        children.push_item(n);
+        if (!n->parent)
+            n->parent = this;
+    }
+
+    XmlNode* ElementNode::pop_child(void)
+    {
+        _reset_hash();
+        _load_children();
+        XmlNode *n = last_child();
+        children.pop_item();
+        if (n->parent == this)
+            n->parent = 0;
+        return n;
+    }
+
+    void ElementNode::set_raw_attributes(const char *s, size_t n)
+    {
+        _reset_hash();
+        raw_attributes.clear();
+        raw_attributes.append(s, n);
+    }
+
+    /**
+     * Region has been validated by TagToken, so it is a sequence of
+     * <code>key="value"</code> pairs separated by whitespace,
+     * possibly followed by @c / of empty tag. Runs of plain value
+     * characters are copied as whole blocks.
+     */
+    void ElementNode::_load_attributes(void)
+    {
+        if (raw_attributes.is_empty())
+            return;
+        _reset_hash();
+
+        const char *s = raw_attributes.get_data();
+        size_t n = raw_attributes.get_length(), i = 0;
+        EntityDecoder entity;
+
+        while (true)
+        {
+            while (i < n && isspace(s[i]))
+                i++;
+            if (i == n || s[i] == '/')
+                break;
+
+            String key, value;
+            size_t start = i;
+            while (s[i] != '=')
+                i++;
+            key.append(s + start, i - start);
+
+            /// Skip <code>="</code>
+            i += 2;
+            start = i;
+            while (s[i] != '"')
+            {
+                if (s[i] == '&')
+                {
+                    value.append(s + start, i - start);
+                    entity.start();
+                    while (entity.is_active())
+                        entity.feed(s[++i], value);
+                    start = i + 1;
+                }
+                i++;
+            }
+            value.append(s + start, i - start);
+            i++;
+
+            attributes.push_item(new AttrNode(std::move(key), std::move(value)));
+            QWE_STAT(count_alloc(sizeof(AttrNode)));
+        }
+        raw_attributes.clear();
+    }
+
+    SubtreeBuilder ElementNode::builder = 0;
+
+    void ElementNode::set_subtree_builder(SubtreeBuilder b)
+    {
+        builder = b;
+    }
+
+    void ElementNode::set_raw_children(String &&s, int flags)
+    {
+        _reset_hash();
+        raw_children = std::move(s);
+        raw_flags = flags;
+    }
+
+    bool ElementNode::has_raw_children(void)
+    {
+        return !raw_children.is_empty();
+    }
+
+    /**
+     * Raw markup is taken out of element before building, so that
+     * builder may add children without recursion.
+     */
+    void ElementNode::_load_children(void)
+    {
+        if (raw_children.is_empty())
+            return;
+        _reset_hash();
+
+        String raw(std::move(raw_children));
+        if (builder && !builder(this, raw, raw_flags))
+            raw_children = std::move(raw);
+    }
+
+    bool ElementNode::replace_child(XmlNode *old, XmlNode *n)
+    {
+        _reset_hash();
+        _load_children();
+        for (int i = 0; i < children.get_length(); i++)
+            if (children[i] == old)
+            {
+                children[i] = n;
+                if (old->parent == this)
+                    old->parent = 0;
+                if (!n->parent)
+                    n->parent = this;
+                return true;
+            }
+        return false;
     }
 
     bool ElementNode::has_children(void)
     {
-        return !(children->is_empty());
+        _load_children();
+        return !(children.is_empty());
     }
 
     bool ElementNode::has_attributes(void)
     {
-        return !(attributes->is_empty());
+        _load_attributes();
+        return !(attributes.is_empty());
     }
 
     String& ElementNode::get_name(void)
@@ -108,43 +577,120 @@ namespace qwe {
         return name;
     }
 
-    void ElementNode::set_name(String &s)
+    void ElementNode::set_name(const String &s)
     {
+        _reset_hash();
         name = String(s);
     }
 
+    node_type ElementNode::get_type(void)
+    {
+        return ELEMENT_NODE;
+    }
+
+    size_t ElementNode::get_memory_size(void)
+    {
+        size_t n = sizeof(ElementNode) + name.get_capacity() + \
+            raw_attributes.get_capacity() + raw_children.get_capacity() + \
+            children.get_memory_size() + attributes.get_memory_size();
+
+        for (int i = 0; i < attributes.get_length(); i++)
+            n += sizeof(AttrNode) + \
+                attributes[i]->get_name().get_capacity() + \
+                attributes[i]->get_value().get_capacity();
+        for (int i = 0; i < children.get_length(); i++)
+            if (!children[i]->is_shared())
+                n += children[i]->get_memory_size();
+        return n;
+    }
+
     /**
-     * Return printable string of element tag with attributes, then
-     * recursively traverse all children and add their printable
-     * strings.
+     * Ancestors of element with no cached hash have none either,
+     * since computing their hashes caches it.
      */
-    String& ElementNode::get_printable(void)
+    void ElementNode::_reset_hash(void)
+    {
+        for (ElementNode *e = this; e && e->hash; e = (ElementNode *)(e->parent))
+            e->hash = 0;
+    }
+
+    /**
+     * Name, attributes and children hashes are mixed in document
+     * order. Members are used directly, so that nothing raw is
+     * built.
+     */
+    unsigned long ElementNode::get_hash(void)
+    {
+        if (hash)
+            return hash;
+
+        unsigned long h = hash_string(name, HASH_SEED ^ ELEMENT_NODE);
+        if (!raw_attributes.is_empty())
+            h = hash_string(raw_attributes, h);
+        for (int i = 0; i < attributes.get_length(); i++)
+        {
+            h = hash_string(attributes[i]->get_name(), h);
+            h = hash_string(attributes[i]->get_value(), h);
+        }
+        if (!raw_children.is_empty())
+            h = hash_string(raw_children, h);
+        for (int i = 0; i < children.get_length(); i++)
+            h = (h ^ children[i]->get_hash()) * 1099511628211UL;
+
+        hash = h ? h : 1;
+        return hash;
+    }
+
+    bool ElementNode::equals(XmlNode *n)
+    {
+        if (n == this)
+            return true;
+        if (n->get_type() != ELEMENT_NODE || n->get_hash() != get_hash())
+            return false;
+
+        ElementNode *e = (ElementNode *)(n);
+        if (!(e->name == name) || \
+            !(e->raw_attributes == raw_attributes) || \
+            !(e->raw_children == raw_children) || \
+            e->attributes.get_length() != attributes.get_length() || \
+            e->children.get_length() != children.get_length())
+            return false;
+        for (int i = 0; i < attributes.get_length(); i++)
+            if (!(e->attributes[i]->get_name() == attributes[i]->get_name()) || \
+                !(e->attributes[i]->get_value() == attributes[i]->get_value()))
+                return false;
+        for (int i = 0; i < children.get_length(); i++)
+            if (!children[i]->equals(e->children[i]))
+                return false;
+        return true;
+    }
+
+    /**
+     * Append element tag with attributes, then recursively traverse
+     * all children and append their representations.
+     */
+    void ElementNode::print(String &out)
     {
-        /// Allocate on heap so we can return a reference.
-        String *s = new String();
         /// Opening tag
-        *s += "<";
-        *s += get_name();
+        out += "<";
+        out += get_name();
 
         /// Attributes
         if (has_attributes())
         {
-            *s += " ";
             AttrList::StlIterator i = attributes_begin(), e = attributes_end();
-            bool first = true;
             while (i != e)
             {
-                if (!first)
-                    *s += " ";
-                first = false;
-                *s += (*i)->get_name();
-                *s += "=\"";
-                *s += (*i)->get_value();
-                *s += "\"";
+                String &value = (*i)->get_value();
+                out += " ";
+                out += (*i)->get_name();
+                out += "=\"";
+                escape(value.get_data(), value.get_length(), true, out);
+                out += "\"";
                 i++;
             }
         }
-        *s += ">";
+        out += ">";
 
         /// Children
         if (has_children())
@@ -152,60 +698,104 @@ namespace qwe {
             NodeList::StlIterator i = children_begin(), e = children_end();
             while (i != e)
             {
-                *s += (*i)->get_printable();
+                (*i)->print(out);
                 i++;
             }
         }
 
         /// Closing tag
-        *s += "</";
-        *s += get_name();
-        *s += ">";
-        return *s;
+        out += "</";
+        out += get_name();
+        out += ">";
     }
 
     NodeList::StlIterator ElementNode::children_begin(void)
     {
-        return children->begin();
+        _load_children();
+        return children.begin();
     }
 
     NodeList::StlIterator ElementNode::children_end(void)
     {
-        return children->end();
+        _load_children();
+        return children.end();
     }
 
     NodeList::StlIterator ElementNode::children_rbegin(void)
     {
-        return children->rbegin();
+        _load_children();
+        return children.rbegin();
     }
 
     NodeList::StlIterator ElementNode::children_rend(void)
     {
-        return children->rend();
+        _load_children();
+        return children.rend();
     }
 
     AttrList::StlIterator ElementNode::attributes_begin(void)
     {
-        return attributes->begin();
+        _load_attributes();
+        return attributes.begin();
     }
 
     AttrList::StlIterator ElementNode::attributes_end(void)
     {
-        return attributes->end();
+        _load_attributes();
+        return attributes.end();
     }
 
     XmlNode* ElementNode::first_child(void)
     {
-        return children->first_item();
+        _load_children();
+        return children.first_item();
     }
 
     XmlNode* ElementNode::last_child(void)
     {
-        return children->last_item();
+        _load_children();
+        return children.last_item();
+    }
+
+    XmlNode* ElementNode::get_child(int i)
+    {
+        _load_children();
+        return children[i];
+    }
+
+    AttrNode* ElementNode::get_attribute(int i)
+    {
+        _load_attributes();
+        return attributes[i];
+    }
+
+    int ElementNode::get_children_count(void)
+    {
+        _load_children();
+        return children.get_length();
+    }
+
+    int ElementNode::get_attributes_count(void)
+    {
+        _load_attributes();
+        return attributes.get_length();
     }
 
     AttrNode* ElementNode::first_attribute(void)
     {
-        return attributes->first_item();
+        _load_attributes();
+        return attributes.first_item();
+    }
+
+    AttrNode* ElementNode::find_attribute(String &name)
+    {
+        AttrList::StlIterator i = attributes_begin(), e = attributes_end();
+        while (i != e)
+        {
+            if ((*i)->get_name() == name)
+                return *i;
+            i++;
+        }
+        return 0;
     }
 }
@@ -4,7 +4,9 @@
 #include <iterator>
 #endif
 #include "qwelist.hpp"
+#include "qwevector.hpp"
 #include "qwestring.hpp"
+#include "qwecheckpoint.hpp"
 
 /**
  * XML structure classes.
@@ -12,9 +14,92 @@
 
 namespace qwe {
 
+    enum node_type {TEXT_NODE, ELEMENT_NODE};
+
+    /**
+     * Appends @a n characters to @a out, replacing markup characters
+     * with entity references.
+     *
+     * @c <, @c & and @c > are always escaped, @c " is escaped only if
+     * @a attribute is true. Runs of characters which need no escaping
+     * are copied to @a out as whole blocks.
+     */
+    void escape(const char *s, size_t n, bool attribute, String &out);
+
+    /**
+     * Incremental decoder of entity and character references.
+     *
+     * Tokens start decoder when @c & is read and feed it following
+     * characters until reference is complete. Decoder state is kept
+     * between feeds, so references may be split across portions of
+     * input. No memory is allocated while decoding.
+     *
+     * Predefined entities (@c amp, @c lt, @c gt, @c quot, @c apos)
+     * and decimal or hexadecimal character references are supported.
+     * Characters are written in UTF-8.
+     */
+    class EntityDecoder {
+    private:
+        /**
+         * Longest reference name which may be valid, like
+         * <code>#x10FFFF</code>.
+         */
+        enum {MAX_NAME = 8};
+
+        /**
+         * Characters read after @c &.
+         */
+        char name[MAX_NAME];
+
+        int length;
+
+        /**
+         * True if @c & has been read and @c ; is expected.
+         */
+        bool active;
+
+        /**
+         * Append decoded reference to string.
+         *
+         * @return False if reference is unknown.
+         */
+        bool decode(String &out);
+
+    public:
+        EntityDecoder(void);
+
+        void flush(void);
+
+        bool is_active(void);
+
+        /**
+         * Start reading reference after @c & has been read.
+         */
+        void start(void);
+
+        /**
+         * Read next character of reference, appending decoded
+         * character to @a out when closing @c ; is read.
+         *
+         * @return False if reference is malformed.
+         */
+        bool feed(char c, String &out);
+
+        /**
+         * Append state of unfinished reference to checkpoint.
+         */
+        void save(CheckpointWriter &w);
+
+        void restore(CheckpointReader &r);
+    };
+
     /**
      * Node of XML document, either text or element.
      *
+     * Node is owned by its parent. A node may be shared by several
+     * parents (see share()); shared nodes are read-only and freed
+     * with release() when their last owner lets them go.
+     *
      * @todo Decouple get_printable(). Implement iterators for traversing
      * the whole tree (depth-first).
      */
@@ -25,18 +110,79 @@ namespace qwe {
          */
         XmlNode* parent;
 
+        /**
+         * Number of owners of node.
+         */
+        int references;
+
     public:
         XmlNode(void);
         virtual ~XmlNode(void);
 
+        /**
+         * Element which node was added to. For shared nodes this is
+         * the first parent which still owns them, or 0.
+         */
         XmlNode* get_parent(void);
 
-        virtual String& get_printable(void) = 0;
+        /**
+         * Adds one more owner to node, so it may be added as a child
+         * of another element.
+         *
+         * Shared nodes and their subtrees must not be changed.
+         *
+         * @return This node.
+         */
+        XmlNode* share(void);
+
+        bool is_shared(void);
+
+        /**
+         * Drops one owner of node, deleting it when none are left.
+         * Nodes which may be shared must be released instead of
+         * deleted.
+         */
+        void release(void);
+
+        /**
+         * Structural hash of subtree: equal subtrees (see equals())
+         * have equal hashes.
+         */
+        virtual unsigned long get_hash(void) = 0;
+
+        /**
+         * True if subtree of node has the same structure, names,
+         * attributes and text as that of @a n.
+         */
+        virtual bool equals(XmlNode *n) = 0;
+
+        virtual node_type get_type(void) = 0;
+
+        /**
+         * Bytes charged to memory account for node and everything it
+         * owns alone. Shared children are not counted, since other
+         * owners keep them.
+         */
+        virtual size_t get_memory_size(void) = 0;
+
+        /**
+         * Appends XML representation of node to @a out.
+         */
+        virtual void print(String &out) = 0;
+
+        /**
+         * Returns printable representation of node.
+         */
+        String get_printable(void);
 
         friend class TextNode;
         friend class ElementNode;
     };
-    typedef List <XmlNode *> NodeList;
+    /**
+     * Most elements have at most two children, which are stored
+     * inline.
+     */
+    typedef SmallVector <XmlNode *, 2> NodeList;
 
 
     /**
@@ -50,19 +196,41 @@ namespace qwe {
         /**
          * Constructs TextNode object with given contents.
          */
-        TextNode(String &s);
+        TextNode(const String &s);
+
+        /**
+         * Constructs TextNode object taking over buffer of @a s.
+         */
+        TextNode(String &&s);
+
+        ~TextNode(void);
 
         /**
          * Returns raw contents of text node.
          */
-        String get_contents(void);
+        String& get_contents(void);
 
-        void set_contents(String &s);
+        void set_contents(const String &s);
+
+        void set_contents(String &&s);
 
         /**
-         * Returns printable representation of text node contents.
+         * Appends more character data to node contents.
          */
-        String& get_printable(void);
+        void append_contents(const String &s);
+
+        unsigned long get_hash(void);
+
+        bool equals(XmlNode *n);
+
+        node_type get_type(void);
+
+        size_t get_memory_size(void);
+
+        /**
+         * Appends text node contents with markup characters escaped.
+         */
+        void print(String &out);
     };
 
     /**
@@ -73,40 +241,121 @@ namespace qwe {
         String name;
         String value;
     public:
-        AttrNode(String &n, String &v);
+        AttrNode(const String &n, const String &v);
+
+        AttrNode(String &&n, String &&v);
+
+        ~AttrNode(void);
 
         String& get_name(void);
 
         String& get_value(void);
 
-        void set_value(String &v);
+        void set_value(const String &v);
     };
-    typedef List <AttrNode *> AttrList;
+    /**
+     * Most elements have at most three attributes, which are stored
+     * inline.
+     */
+    typedef SmallVector <AttrNode *, 3> AttrList;
+
+    class ElementNode;
+
+    /**
+     * Function which builds children of element @a e from markup
+     * @a raw recorded instead of them, with @a flags recorded along
+     * with it.
+     *
+     * @return False if markup is malformed; no children are added
+     * then.
+     *
+     * @see ElementNode::set_raw_children()
+     */
+    typedef bool (*SubtreeBuilder)(ElementNode *e, String &raw, int flags);
 
     /**
      * Element node with attributes and children.
+     *
+     * Element owns its children and attributes, so deleting an
+     * element frees the whole subtree.
      */
     class ElementNode : public XmlNode {
     private:
+        /**
+         * Flags passed to SubtreeBuilder with raw children. Declared
+         * first, so that it takes padding after XmlNode fields.
+         */
+        int raw_flags;
+
         /**
          * Name of XML element.
          */
         String name;
 
-        NodeList *children;
-        AttrList *attributes;
+        NodeList children;
+        AttrList attributes;
+
+        /**
+         * Attribute region of start tag which has not been split into
+         * AttrNode objects yet, empty if there is none.
+         */
+        String raw_attributes;
+
+        /**
+         * Split ElementNode::raw_attributes into attributes if it is
+         * not empty.
+         */
+        void _load_attributes(void);
+
+        /**
+         * Markup of element contents (including closing tag) which
+         * has not been built into children yet, empty if there is
+         * none.
+         */
+        String raw_children;
+
+        /**
+         * Builder used for all elements with raw children.
+         */
+        static SubtreeBuilder builder;
+
+        /**
+         * Cached structural hash, 0 if not computed yet.
+         */
+        unsigned long hash;
+
+        /**
+         * Build children from ElementNode::raw_children if it is not
+         * empty.
+         */
+        void _load_children(void);
+
+        /**
+         * Forget cached hash of element and its ancestors after a
+         * change of subtree.
+         */
+        void _reset_hash(void);
+
+        friend class TextNode;
 
     public:
         ElementNode(void);
 
         ~ElementNode(void);
 
-        ElementNode(String &s);
+        ElementNode(const String &s);
+
+        ElementNode(String &&s);
 
         /**
          * Adds new attribute to element provided its key and value.
          */
-        void add_attribute(String &name, String &value);
+        void add_attribute(const String &name, const String &value);
+
+        /**
+         * Adds new attribute taking over buffers of key and value.
+         */
+        void add_attribute(String &&name, String &&value);
 
         /**
          * Adds new attribute using a pointer to existing AttrNode object.
@@ -123,6 +372,56 @@ namespace qwe {
          */
         void add_child(TextNode *n);
 
+        /**
+         * Detaches last child node from element.
+         *
+         * @return Detached node whose reference is now owned by the
+         * caller.
+         */
+        XmlNode* pop_child(void);
+
+        /**
+         * Puts @a n in place of child @a old.
+         *
+         * @return False if @a old is not a child of element. Otherwise
+         * @a old is detached and owned by the caller.
+         */
+        bool replace_child(XmlNode *old, XmlNode *n);
+
+        /**
+         * Sets raw attribute region of start tag (everything between
+         * element name and closing @c >) which is split into
+         * attributes only when they are first accessed.
+         *
+         * Region must be already validated, since it is split without
+         * any checks. Attributes of element must be empty.
+         */
+        void set_raw_attributes(const char *s, size_t n);
+
+        /**
+         * Sets raw markup of element contents, from the end of
+         * opening tag to the end of closing tag, which is built into
+         * children with current SubtreeBuilder only when they are
+         * first accessed. Element must have no children.
+         *
+         * @param flags Settings builder needs to read markup the way
+         * it would have been read eagerly, opaque to element.
+         *
+         * Malformed markup is kept, so that children stay empty and
+         * has_raw_children() remains true after access.
+         */
+        void set_raw_children(String &&s, int flags = 0);
+
+        /**
+         * True if children have not been built from raw markup yet.
+         */
+        bool has_raw_children(void);
+
+        /**
+         * Sets function which builds raw children of all elements.
+         */
+        static void set_subtree_builder(SubtreeBuilder b);
+
         bool has_children(void);
 
         bool has_attributes(void);
@@ -132,13 +431,38 @@ namespace qwe {
          */
         String& get_name(void);
 
-        void set_name(String &s);
+        void set_name(const String &s);
+
+        node_type get_type(void);
+
+        /**
+         * Raw attributes and children are counted by their markup.
+         */
+        size_t get_memory_size(void);
+
+        /**
+         * Hash is cached until element or its subtree is changed by
+         * methods of ElementNode and TextNode. Changes made through
+         * references returned by get_name(), get_contents() and
+         * AttrNode are not seen by it, so those must be done before
+         * hash is requested. Attributes and children which are still
+         * raw are hashed by their markup without building them.
+         */
+        unsigned long get_hash(void);
+
+        /**
+         * Children are compared by pointer first, so comparing
+         * elements whose children are shared is cheap. Raw
+         * attributes and children are compared by markup; element
+         * with raw markup is never equal to one with built nodes.
+         */
+        bool equals(XmlNode *n);
 
         /**
-         * Returns printable representation of element node with all
+         * Appends printable representation of element node with all
          * attributes and children.
          */
-        String& get_printable(void);
+        void print(String &out);
 
         /**
          * Iterators for children
@@ -165,6 +489,22 @@ namespace qwe {
         XmlNode* first_child(void);
         XmlNode* last_child(void);
         AttrNode* first_attribute(void);
+
+        /**
+         * Constant-time access by index (starting from 0), which must
+         * be less than count.
+         */
+        XmlNode* get_child(int i);
+        AttrNode* get_attribute(int i);
+
+        int get_children_count(void);
+        int get_attributes_count(void);
+
+        /**
+         * Returns attribute with given name or 0 if element has no
+         * such attribute.
+         */
+        AttrNode* find_attribute(String &name);
     };
 }
 #endif